@@ -0,0 +1,31 @@
+#!/bin/bash
+# Renders examples/ex0.txt with every tile/pixel ordering and compares cache
+# behaviour. With perf available it reports L2 and last-level cache misses,
+# otherwise just the wall time.
+#
+#   bench/orderings.sh [SIZE] [THREADS]
+#
+# SIZE scales the frame down from 10000x10000 (default 2000); the event list
+# can be overridden with PERF_EVENTS for CPUs that name their counters
+# differently.
+
+set -e
+cd "$(dirname "$0")/.."
+size=${1:-2000}
+threads=${2:-$(nproc)}
+events=${PERF_EVENTS:-l2_rqsts.miss,LLC-loads,LLC-load-misses}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+sed "1s|.*|png $size $size $out/ex0.png|" examples/ex0.txt >"$out/ex0.txt"
+
+for order in row morton hilbert spiral; do
+  echo "== $order"
+  cmd=(./main --quiet --threads "$threads" --tile-order $order --pixel-order $order "$out/ex0.txt")
+  if command -v perf >/dev/null 2>&1; then
+    perf stat -e "$events" "${cmd[@]}" 2>&1 | grep -E "${events//,/|}|elapsed"
+  else
+    TIMEFORMAT="%R s"
+    time "${cmd[@]}"
+  fi
+done
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Renders examples/reflection4.txt and examples/ex2.txt with global
+# illumination through the wavefront integrator, with and without reordering
+# scattered rays before traversal. With perf available it reports L2 and
+# last-level cache misses, otherwise just the wall time.
+#
+#   bench/reorder.sh [SIZE] [THREADS]
+#
+# SIZE is the frame edge (default 400); PERF_EVENTS overrides the event list
+# as for bench/orderings.sh.
+
+set -e
+cd "$(dirname "$0")/.."
+size=${1:-400}
+threads=${2:-$(nproc)}
+events=${PERF_EVENTS:-l2_rqsts.miss,LLC-loads,LLC-load-misses}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+sed "1s|.*|png $size $size $out/reflection4.png\naa 4|" examples/reflection4.txt >"$out/reflection4.txt"
+sed "1s|.*|png $size $size $out/ex2.png\ngi 1|; s|^aa .*|aa 4|" examples/ex2.txt >"$out/ex2.txt"
+
+for scene in reflection4 ex2; do
+  for reorder in --no-reorder ""; do
+    echo "== $scene ${reorder:-reordered}"
+    cmd=(./main --quiet --threads "$threads" --integrator wavefront $reorder "$out/$scene.txt")
+    if command -v perf >/dev/null 2>&1; then
+      perf stat -e "$events" "${cmd[@]}" 2>&1 | grep -E "${events//,/|}|elapsed"
+    else
+      TIMEFORMAT="%R s"
+      time "${cmd[@]}"
+    fi
+  done
+done
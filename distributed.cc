@@ -0,0 +1,266 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "distributed.hh"
+#include "progress.hh"
+
+// a tile that keeps killing workers is a bug, not bad luck
+static const int max_failures = 3;
+
+struct worker
+{
+  pid_t pid = -1;
+  int fd = -1;
+  tile *job = nullptr;
+};
+
+bool send_all(int fd, const void *data, size_t n)
+{
+  auto p = static_cast<const char *>(data);
+  while (n)
+  {
+    auto k = write(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void *data, size_t n)
+{
+  auto p = static_cast<char *>(data);
+  while (n)
+  {
+    auto k = read(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+  }
+  return true;
+}
+
+template <typename T>
+static bool send_array(int fd, std::vector<T> &v)
+{
+  return send_all(fd, v.data(), v.size() * sizeof(T));
+}
+
+template <typename T>
+static bool recv_array(int fd, std::vector<T> &v)
+{
+  return recv_all(fd, v.data(), v.size() * sizeof(T));
+}
+
+static bool send_tile(int fd, framebuffer &fb)
+{
+  return send_array(fd, fb.sum) && send_array(fd, fb.sum2) &&
+         send_array(fd, fb.samples) && send_array(fd, fb.hit);
+}
+
+static bool recv_tile(int fd, framebuffer &fb)
+{
+  return recv_array(fd, fb.sum) && recv_array(fd, fb.sum2) &&
+         recv_array(fd, fb.samples) && recv_array(fd, fb.hit);
+}
+
+static void serve(scene &sc, const pixel_order &order, const render_options &opts, int fd)
+{
+  tile t;
+  while (recv_all(fd, &t, sizeof(t)))
+  {
+    framebuffer fb(t.x1 - t.x0, t.y1 - t.y0, t.x0, t.y0);
+    render_tile(sc, fb, t, order, opts);
+    auto rays = take_rays();
+    if (!send_tile(fd, fb) || !send_all(fd, &rays, sizeof(rays)))
+      return;
+  }
+}
+
+static bool spawn(scene &sc, const pixel_order &order, const render_options &opts, worker &w,
+                  std::vector<worker> &workers)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    return false;
+
+  auto pid = fork();
+  if (pid < 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0)
+  {
+    close(fds[0]);
+    for (auto &other : workers)
+    {
+      if (other.fd >= 0)
+        close(other.fd);
+    }
+    serve(sc, order, opts, fds[1]);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  w.pid = pid;
+  w.fd = fds[0];
+  w.job = nullptr;
+  return true;
+}
+
+static void retire(worker &w)
+{
+  close(w.fd);
+  waitpid(w.pid, nullptr, 0);
+  w.fd = -1;
+  w.pid = -1;
+}
+
+bool render_distributed(scene &sc, framebuffer &fb, const render_options &opts,
+                        const std::function<void(const tile &)> &tile_done)
+{
+  // a dead worker must show up as a failed write, not kill the coordinator
+  std::signal(SIGPIPE, SIG_IGN);
+
+  auto win = window(sc);
+  auto tiles = make_tiles(win, opts.tile_size, opts.tile_curve);
+  pixel_order order(opts.tile_size, opts.pixel_curve);
+  std::deque<tile *> queue;
+  std::vector<int> failures(tiles.size());
+  for (auto &t : tiles)
+  {
+    queue.push_back(&t);
+  }
+
+  std::vector<worker> workers(opts.workers);
+  for (auto &w : workers)
+  {
+    if (!spawn(sc, order, opts, w, workers))
+    {
+      std::cerr << "cannot start worker: " << strerror(errno) << std::endl;
+      for (auto &other : workers)
+      {
+        if (other.fd >= 0)
+          retire(other);
+      }
+      return false;
+    }
+  }
+
+  size_t done = 0;
+  bool ok = true;
+  std::unique_ptr<progress_reporter> progress;
+  size_t pixels = size_t(fb.width) * fb.height;
+  if (!opts.quiet)
+    progress.reset(new progress_reporter(1, pixels, pixels,
+                                         opts.progress_interval, opts.progress_json));
+
+  // puts the worker's tile back in the queue and starts a replacement
+  auto fail = [&](worker &w)
+  {
+    auto t = w.job;
+    retire(w);
+    if (++failures[t - tiles.data()] >= max_failures)
+    {
+      std::cerr << "\ntile at " << t->x0 << ',' << t->y0 << " failed "
+                << max_failures << " times" << std::endl;
+      ok = false;
+      return;
+    }
+    queue.push_front(t);
+    if (!spawn(sc, order, opts, w, workers))
+      std::cerr << "\ncannot restart worker: " << strerror(errno) << std::endl;
+  };
+
+  while (ok && done < tiles.size())
+  {
+    for (auto &w : workers)
+    {
+      if (w.fd >= 0 && !w.job && !queue.empty())
+      {
+        w.job = queue.front();
+        queue.pop_front();
+        if (!send_all(w.fd, w.job, sizeof(tile)))
+          fail(w);
+      }
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<worker *> busy;
+    for (auto &w : workers)
+    {
+      if (w.fd >= 0 && w.job)
+      {
+        fds.push_back({w.fd, POLLIN, 0});
+        busy.push_back(&w);
+      }
+    }
+    if (fds.empty())
+    {
+      if (ok)
+        std::cerr << "\nno workers left" << std::endl;
+      ok = false;
+      break;
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "\npoll: " << strerror(errno) << std::endl;
+      ok = false;
+      break;
+    }
+
+    for (size_t k = 0; k < fds.size() && ok; ++k)
+    {
+      if (!fds[k].revents)
+        continue;
+      auto &w = *busy[k];
+      auto &t = *w.job;
+      framebuffer tile_fb(t.x1 - t.x0, t.y1 - t.y0, t.x0, t.y0);
+      uint64_t rays;
+      if (!recv_tile(w.fd, tile_fb) || !recv_all(w.fd, &rays, sizeof(rays)))
+      {
+        fail(w);
+        continue;
+      }
+      fb.merge(tile_fb);
+      if (tile_done)
+        tile_done(t);
+      w.job = nullptr;
+      ++done;
+      if (progress)
+      {
+        uint64_t samples = 0;
+        for (auto n : tile_fb.samples)
+          samples += n;
+        progress->add(0, tile_fb.samples.size(), samples, rays);
+      }
+    }
+  }
+
+  progress.reset();
+
+  // workers exit when their socket closes
+  for (auto &w : workers)
+  {
+    if (w.fd >= 0)
+      retire(w);
+  }
+
+  return ok;
+}
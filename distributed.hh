@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "render.hh"
+
+// writes all n bytes to fd, retrying short and interrupted writes; false when
+// the other end is gone
+bool send_all(int fd, const void *data, size_t n);
+
+/**
+ * Renders with forked worker processes instead of threads. The scene is parsed
+ * once and inherited by every worker; tiles go out over a Unix socket pair per
+ * worker and come back as raw accumulation data. A worker that dies is
+ * replaced and its tile handed out again. tile_done is called as each tile
+ * comes back.
+ */
+bool render_distributed(scene &sc, framebuffer &fb, const render_options &opts,
+                        const std::function<void(const tile &)> &tile_done);
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include "framebuffer.hh"
+
+float gamma(float l, float exposure)
+{
+  l = std::clamp(l, 0.0f, 1.0f);
+  if (exposure)
+  {
+    l = 1 - std::exp(-l * exposure);
+  }
+  return srgb(l);
+}
+
+float srgb(float l)
+{
+  return l <= 0.0031308 ? 12.92 * l : 1.055 * std::pow(l, 1 / 2.4) - 0.055;
+}
+
+static uint32_t bits(float f)
+{
+  uint32_t b;
+  std::memcpy(&b, &f, sizeof(b));
+  return b;
+}
+
+static float from_bits(uint32_t b)
+{
+  float f;
+  std::memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+/**
+ * The smallest l that encodes to each 8-bit value, found by bisecting over the
+ * bit patterns of [0, 1] (which sort like the floats they hold), so looking a
+ * value up gives exactly what srgb(l) * 255 truncates to without a pow call.
+ */
+static const std::array<float, 256> &srgb_thresholds()
+{
+  static const auto table = []
+  {
+    std::array<float, 256> t;
+    for (int v = 0; v < 256; ++v)
+    {
+      uint32_t lo = 0, hi = bits(1.0f);
+      while (lo < hi)
+      {
+        auto mid = lo + (hi - lo) / 2;
+        if ((unsigned char)(srgb(from_bits(mid)) * 255) >= v)
+          hi = mid;
+        else
+          lo = mid + 1;
+      }
+      t[v] = from_bits(lo);
+    }
+    return t;
+  }();
+  return table;
+}
+
+unsigned char srgb_byte(float l)
+{
+  auto &t = srgb_thresholds();
+  int v = 0;
+  for (int step = 128; step; step /= 2)
+  {
+    if (l >= t[v + step])
+      v += step;
+  }
+  return v;
+}
+
+float luminance(vec c)
+{
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+framebuffer::framebuffer(int width, int height, int x0, int y0)
+    : width(width), height(height), x0(x0), y0(y0), sum(width * height),
+      sum2(width * height), samples(width * height), hit(width * height){};
+
+int framebuffer::index(int i, int j)
+{
+  return (i - y0) * width + (j - x0);
+}
+
+void framebuffer::add(int i, int j, vec c, bool hit_any)
+{
+  auto k = index(i, j);
+  sum[k] += c;
+  sum2[k] += luminance(c) * luminance(c);
+  samples[k] += 1;
+  hit[k] |= hit_any;
+}
+
+void framebuffer::merge(framebuffer &tile)
+{
+  for (int i = 0; i < tile.height; ++i)
+  {
+    auto src = i * tile.width;
+    auto dst = index(tile.y0 + i, tile.x0);
+    std::copy_n(&tile.sum[src], tile.width, &sum[dst]);
+    std::copy_n(&tile.sum2[src], tile.width, &sum2[dst]);
+    std::copy_n(&tile.samples[src], tile.width, &samples[dst]);
+    std::copy_n(&tile.hit[src], tile.width, &hit[dst]);
+  }
+}
+
+void framebuffer::tonemap(std::vector<unsigned char> &image, float exposure)
+{
+  tonemap(image, exposure, {x0, y0, x0 + width, y0 + height});
+}
+
+// a row at a time: the mean, clamp and exposure loops run over plain float
+// arrays, where the compiler can vectorize them, and the sRGB step is a table
+void framebuffer::tonemap(std::vector<unsigned char> &image, float exposure, const tile &t)
+{
+  int w = t.x1 - t.x0;
+  std::vector<float> row(3 * w);
+  for (int i = t.y0; i < t.y1; ++i)
+  {
+    auto k0 = index(i, t.x0);
+    for (int j = 0; j < w; ++j)
+    {
+      float n = std::max(1, samples[k0 + j]);
+      row[3 * j] = std::clamp(sum[k0 + j].x / n, 0.0f, 1.0f);
+      row[3 * j + 1] = std::clamp(sum[k0 + j].y / n, 0.0f, 1.0f);
+      row[3 * j + 2] = std::clamp(sum[k0 + j].z / n, 0.0f, 1.0f);
+    }
+    if (exposure)
+    {
+      for (auto &l : row)
+        l = 1 - std::exp(-l * exposure);
+    }
+    for (int j = 0; j < w; ++j)
+    {
+      auto k = k0 + j;
+      if (!hit[k])
+        continue;
+      image[4 * k] = srgb_byte(row[3 * j]);
+      image[4 * k + 1] = srgb_byte(row[3 * j + 1]);
+      image[4 * k + 2] = srgb_byte(row[3 * j + 2]);
+      image[4 * k + 3] = 255;
+    }
+  }
+}
+
+void framebuffer::sample_counts(int &min, float &avg, int &max)
+{
+  auto [lo, hi] = std::minmax_element(samples.begin(), samples.end());
+  min = *lo;
+  max = *hi;
+  avg = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+}
+
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 0, 0, 0, 2};
+
+template <typename T>
+static void write_array(std::ostream &s, std::vector<T> &v)
+{
+  s.write(reinterpret_cast<char *>(v.data()), v.size() * sizeof(T));
+}
+
+template <typename T>
+static void read_array(std::istream &s, std::vector<T> &v)
+{
+  s.read(reinterpret_cast<char *>(v.data()), v.size() * sizeof(T));
+}
+
+bool framebuffer::save(const std::string &filename, int pass)
+{
+  auto tmp = filename + ".part";
+  {
+    std::ofstream fs(tmp, std::ios::binary);
+    int header[5] = {width, height, x0, y0, pass};
+    fs.write(checkpoint_magic, sizeof(checkpoint_magic));
+    fs.write(reinterpret_cast<char *>(header), sizeof(header));
+    write_array(fs, sum);
+    write_array(fs, sum2);
+    write_array(fs, samples);
+    write_array(fs, hit);
+    if (!fs.flush())
+      return false;
+  }
+  return !std::rename(tmp.c_str(), filename.c_str());
+}
+
+bool framebuffer::load(const std::string &filename, int &pass)
+{
+  std::ifstream fs(filename, std::ios::binary);
+  char magic[sizeof(checkpoint_magic)];
+  int header[5];
+  fs.read(magic, sizeof(magic));
+  fs.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!fs || memcmp(magic, checkpoint_magic, sizeof(magic)) ||
+      header[0] != width || header[1] != height || header[2] != x0 || header[3] != y0)
+  {
+    return false;
+  }
+  pass = header[4];
+  read_array(fs, sum);
+  read_array(fs, sum2);
+  read_array(fs, samples);
+  read_array(fs, hit);
+  return bool(fs);
+}
+
+static bool little_endian()
+{
+  uint16_t one = 1;
+  unsigned char first;
+  std::memcpy(&first, &one, 1);
+  return first;
+}
+
+static float swap_bytes(float f)
+{
+  auto b = bits(f);
+  return from_bits((b >> 24) | ((b >> 8) & 0xff00) | ((b << 8) & 0xff0000) | (b << 24));
+}
+
+bool framebuffer::save_pfm(const std::string &filename, const tile &frame)
+{
+  int w = frame.x1 - frame.x0, h = frame.y1 - frame.y0;
+  auto tmp = filename + ".part";
+  {
+    std::ofstream fs(tmp, std::ios::binary);
+    fs << "PF\n"
+       << w << ' ' << h << '\n'
+       << (little_endian() ? "-1.0" : "1.0") << '\n';
+
+    // PFM rows run bottom to top
+    std::vector<float> row(3 * w);
+    for (int i = frame.y1 - 1; i >= frame.y0; --i)
+    {
+      std::fill(row.begin(), row.end(), -0.0f);
+      for (int j = std::max(frame.x0, x0); j < std::min(frame.x1, x0 + width); ++j)
+      {
+        if (i < y0 || i >= y0 + height)
+          break;
+        auto k = index(i, j);
+        if (!hit[k])
+          continue;
+        auto c = sum[k] / std::max(1, samples[k]);
+        // +0, so a black pixel that was hit stays opaque
+        row[3 * (j - frame.x0)] = c.x + 0.0f;
+        row[3 * (j - frame.x0) + 1] = c.y + 0.0f;
+        row[3 * (j - frame.x0) + 2] = c.z + 0.0f;
+      }
+      fs.write(reinterpret_cast<char *>(row.data()), row.size() * sizeof(float));
+    }
+    if (!fs.flush())
+      return false;
+  }
+  return !std::rename(tmp.c_str(), filename.c_str());
+}
+
+bool framebuffer::load_pfm(const std::string &filename)
+{
+  std::ifstream fs(filename, std::ios::binary);
+  std::string magic;
+  int w, h;
+  float scale;
+  if (!(fs >> magic >> w >> h >> scale) || magic != "PF" || w <= 0 || h <= 0)
+    return false;
+  fs.get(); // the single whitespace before the data
+
+  *this = framebuffer(w, h);
+  bool swap = (scale < 0) != little_endian();
+  std::vector<float> row(3 * w);
+  for (int i = h - 1; i >= 0; --i)
+  {
+    if (!fs.read(reinterpret_cast<char *>(row.data()), row.size() * sizeof(float)))
+      return false;
+    for (int j = 0; j < w; ++j)
+    {
+      vec c(row[3 * j], row[3 * j + 1], row[3 * j + 2]);
+      if (swap)
+        c = vec(swap_bytes(c.x), swap_bytes(c.y), swap_bytes(c.z));
+      add(i, j, c, !(c.x == 0 && std::signbit(c.x)));
+    }
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "tiles.hh"
+#include "vec.hh"
+
+// linear radiance to display: clamped, exposed, then sRGB encoded
+float gamma(float l, float exposure);
+// just the sRGB transfer function, for l in [0, 1]
+float srgb(float l);
+// the 8-bit value gamma(l, 0) * 255 comes out as, for l in [0, 1]
+unsigned char srgb_byte(float l);
+float luminance(vec c);
+
+/**
+ * Linear radiance summed per pixel, kept apart from the 8-bit image so more
+ * samples can keep arriving after it has been tone-mapped. A framebuffer can
+ * also cover just a tile of the image, starting at (x0, y0).
+ */
+class framebuffer
+{
+public:
+  int width, height, x0, y0;
+  std::vector<vec> sum;
+  std::vector<float> sum2; // squared luminance, for the variance
+  std::vector<int> samples;
+  std::vector<unsigned char> hit;
+
+  framebuffer(int width, int height, int x0 = 0, int y0 = 0);
+  int index(int i, int j);
+  void add(int i, int j, vec c, bool hit_any);
+  // copy in the pixels of a tile-sized buffer
+  void merge(framebuffer &tile);
+  // image is the size of the framebuffer, not of the whole frame
+  void tonemap(std::vector<unsigned char> &image, float exposure);
+  // just the pixels of t, which must lie inside the framebuffer
+  void tonemap(std::vector<unsigned char> &image, float exposure, const tile &t);
+  void sample_counts(int &min, float &avg, int &max);
+
+  // Checkpoints hold the sums and the per-pixel sample counts, which double as
+  // each pixel's position in its random stream. pass is the next pass to run.
+  bool save(const std::string &filename, int pass);
+  bool load(const std::string &filename, int &pass);
+
+  // The mean radiance of every pixel of frame as a PFM image, padded out
+  // beyond the framebuffer. Pixels without a hit, which come out transparent
+  // in a PNG, are stored as -0 so tone-mapping the PFM later can tell.
+  bool save_pfm(const std::string &filename, const tile &frame);
+  // replaces the framebuffer with one sample per pixel from a PFM image
+  bool load_pfm(const std::string &filename);
+};
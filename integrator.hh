@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "rng.hh"
+#include "scene.hh"
+
+// The pieces of a sample that the depth-first ray_trace and the wavefront
+// integrator share, so both trace exactly the same light paths.
+
+// rays the calling thread has traced, see take_rays
+extern thread_local uint64_t rays_traced;
+
+vec sample_unit_sphere(rng &r);
+// light reaching p on obj, with normal n, from light, shadow ray included;
+// index is the light's in sc.lights, for the light's occluder cache, or -1
+// for lights not in the scene
+vec illuminate(scene &sc, light &light, object *obj, vec p, vec n, int index = -1);
+// a light to shade a point with, and the weight of its light
+struct light_choice
+{
+  int index;
+  float weight;
+};
+// appends the lights to shade p, with normal n, with: all of the scene's,
+// weighted 1, or with sc.light_samples, the ones outside the light tree and
+// that many picked from it with gen, weighted by the inverse of their odds
+void choose_lights(scene &sc, vec p, vec n, rng &gen, std::vector<light_choice> &chosen);
+// whether a ray of this weight is worth tracing, with Russian roulette
+bool keep_ray(scene &sc, vec &weight, rng &gen);
+
+// a ray a hit sends on, the share of its light that reaches the sample, and
+// the branch of the hit ray's rng its own stream splits off
+struct scattered_ray
+{
+  vec o, dir, weight;
+  int branch;
+};
+// what a hit does with the ray that found it
+struct hit_shading
+{
+  // the normal to shade with: facing the ray, perturbed by roughness
+  vec n;
+  // the share of the hit's diffuse light in the sample, and whether it
+  // survived roulette; only then are lights chosen and indirect light gathered
+  vec lit;
+  bool diffuse = false;
+  // with depth left, a diffuse hit is also lit by what this direction sees,
+  // traced with the hit ray's rng split(0)
+  bool indirect = false;
+  vec indirect_dir;
+  // the refraction and reflection rays worth tracing, in that order
+  int count = 0;
+  scattered_ray rays[2];
+};
+// shades the hit at p on obj of a ray along dir, of this weight, with d
+// indirect levels and bounces reflections left; appends the lights to shade
+// it with to chosen. Draws from gen in one fixed order, so both integrators
+// take the same path
+void shade_hit(scene &sc, object *obj, vec p, vec dir, vec weight, int d, int bounces, rng &gen,
+               std::vector<light_choice> &chosen, hit_shading &hit);
+// the camera ray through a random point of pixel (i, j), drawn from gen, the
+// sample's own stream; false when the pixel sees nothing (off the fisheye)
+bool camera_ray(scene &sc, int i, int j, rng &gen, vec &origin, vec &dir);
+// whether a pixel with n samples summing to sum, and sum2 squared, needs
+// another, at most limit
+bool needs_sample(scene &sc, int limit, int n, float sum, float sum2);
+int max_samples(scene &sc);
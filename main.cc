@@ -1,18 +1,367 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <thread>
 #include "lodepng.hh"
+#include "numa.hh"
 #include "scene.hh"
 #include "render.hh"
+#include "server.hh"
 
 using namespace std;
 
+// the scene's own view and all of its cameras
+std::vector<view *> views(scene &sc)
+{
+  std::vector<view *> vs = {&sc};
+  for (auto &cam : sc.cameras)
+  {
+    vs.push_back(&cam.second);
+  }
+  return vs;
+}
+
+static bool exists(const std::string &filename)
+{
+  return std::ifstream(filename).good();
+}
+
+/**
+ * Renders sc as one image of many, a frame or a camera, announced as "LABEL
+ * NAME: FILE", with NAME appended to its checkpoint and resume files. An
+ * image with no checkpoint to resume from yet starts afresh. The image is
+ * still encoding when this returns; encoding, the previous image's, is
+ * finished first, and then replaced by it. False when either fails.
+ */
+static bool render_next(scene &sc, const render_options &opts, const std::string &label,
+                        const std::string &name, std::unique_ptr<png_pipeline> &encoding)
+{
+  auto next_opts = opts;
+  if (!next_opts.checkpoint.empty())
+    next_opts.checkpoint += "." + name;
+  if (!next_opts.resume.empty())
+  {
+    next_opts.resume += "." + name;
+    if (!exists(next_opts.resume))
+      next_opts.resume.clear();
+  }
+
+  // stdout only carries JSON lines with --progress-json
+  if (!opts.quiet)
+    (opts.progress_json ? cerr : cout) << label << ' ' << name << ": " << sc.filename << endl;
+  auto out = render_file_async(sc, next_opts);
+  // the previous image is written out even when this one failed
+  bool written = !encoding || encoding->finish();
+  encoding = std::move(out);
+  return encoding && written;
+}
+
+void usage(char *prog)
+{
+  cerr << "usage: " << prog << " [options] scene.txt\n"
+       << "       " << prog << " --tonemap in.pfm [--expose X] out.png\n"
+       << "  --threads N            worker threads (default: all cores)\n"
+       << "  --progressive          render one sample per pixel per pass\n"
+       << "  --snapshot-passes N    progressive: write the PNG every N passes\n"
+       << "  --snapshot-seconds T   progressive: write the PNG every T seconds\n"
+       << "  --time-budget S        keep adding passes for S seconds, then write the PNG\n"
+       << "  --checkpoint FILE      save the render state to FILE between passes\n"
+       << "  --checkpoint-seconds T save checkpoints at most every T seconds\n"
+       << "  --resume FILE          continue from a checkpoint (and keep saving to it)\n"
+       << "  --workers N            render tiles in N worker processes\n"
+       << "  --tile-size N          tile edge in pixels (default: 32)\n"
+       << "  --tile-order ORDER     row, morton, hilbert or spiral (default: row)\n"
+       << "  --pixel-order ORDER    the same, for the pixels within a tile\n"
+       << "  --integrator NAME      depth (one sample at a time) or wavefront (a bounce\n"
+       << "                         at a time for a whole tile); default: depth\n"
+       << "  --no-reorder           wavefront: trace secondary rays in the order made\n"
+       << "  --no-packets           trace camera rays one at a time\n"
+       << "  --progress-interval S  report progress every S seconds (default: 1)\n"
+       << "  --progress-json        report progress as JSON lines\n"
+       << "  --quiet                no progress output\n"
+       << "  --numa                 pin threads to NUMA nodes, report local/remote tiles\n"
+       << "  --numa-replicate       --numa with a copy of the scene on every node\n"
+       << "  --pfm                  also write the linear radiance, as NAME.pfm\n"
+       << "  --expose X             override the scene's exposure\n"
+       << "  --crop X0 Y0 X1 Y1     render and write only this window of the image\n"
+       << "  --crop-full X0 Y0 X1 Y1  render only this window, write a full-size image\n"
+       << "  --server               load the scene once, then render requests from stdin\n"
+       << "  --server-socket PATH   the same, listening on a Unix socket\n"
+       << "  --camera NAME          render only this camera (may be repeated)\n"
+       << "  --frames FIRST LAST    render only these frames of an animation" << endl;
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc > 1)
+  render_options opts;
+  opts.threads = std::max(1u, std::thread::hardware_concurrency());
+  char *scene_file = nullptr;
+  bool crop = false, crop_full = false, server = false;
+  int crop_window[4];
+  std::string server_socket;
+  std::vector<std::string> camera_names;
+  int frames[2] = {0, -1};
+  const char *tonemap_input = nullptr;
+  bool expose = false;
+  float exposure = 0;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+    {
+      opts.threads = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--progressive"))
+    {
+      opts.progressive = true;
+    }
+    else if (!strcmp(argv[i], "--snapshot-passes") && i + 1 < argc)
+    {
+      opts.progressive = true;
+      opts.snapshot_passes = std::max(0, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--snapshot-seconds") && i + 1 < argc)
+    {
+      opts.progressive = true;
+      opts.snapshot_seconds = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--time-budget") && i + 1 < argc)
+    {
+      opts.time_budget = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+    {
+      opts.checkpoint = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--checkpoint-seconds") && i + 1 < argc)
+    {
+      opts.checkpoint_seconds = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--resume") && i + 1 < argc)
+    {
+      opts.resume = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+    {
+      opts.workers = std::max(0, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc)
+    {
+      opts.tile_size = std::max(1, atoi(argv[++i]));
+    }
+    else if ((!strcmp(argv[i], "--tile-order") || !strcmp(argv[i], "--pixel-order")) && i + 1 < argc)
+    {
+      auto &c = argv[i][2] == 't' ? opts.tile_curve : opts.pixel_curve;
+      if (!parse_curve(argv[++i], c))
+      {
+        cerr << "unknown order " << argv[i] << " (row, morton, hilbert or spiral)" << endl;
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--progress-interval") && i + 1 < argc)
+    {
+      opts.progress_interval = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--progress-json"))
+    {
+      opts.progress_json = true;
+    }
+    else if (!strcmp(argv[i], "--quiet"))
+    {
+      opts.quiet = true;
+    }
+    else if (!strcmp(argv[i], "--numa"))
+    {
+      opts.numa = true;
+    }
+    else if (!strcmp(argv[i], "--numa-replicate"))
+    {
+      opts.numa = opts.numa_replicate = true;
+    }
+    else if (!strcmp(argv[i], "--camera") && i + 1 < argc)
+    {
+      camera_names.push_back(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--frames") && i + 2 < argc)
+    {
+      frames[0] = atoi(argv[++i]);
+      frames[1] = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--server"))
+    {
+      server = true;
+    }
+    else if (!strcmp(argv[i], "--server-socket") && i + 1 < argc)
+    {
+      server_socket = argv[++i];
+    }
+    else if ((!strcmp(argv[i], "--crop") || !strcmp(argv[i], "--crop-full")) && i + 4 < argc)
+    {
+      crop = true;
+      crop_full = !strcmp(argv[i], "--crop-full");
+      for (auto &x : crop_window)
+      {
+        x = atoi(argv[++i]);
+      }
+    }
+    else if (!strcmp(argv[i], "--integrator") && i + 1 < argc)
+    {
+      std::string name = argv[++i];
+      if (name != "depth" && name != "wavefront")
+      {
+        cerr << "unknown integrator " << name << " (depth or wavefront)" << endl;
+        return 1;
+      }
+      opts.wavefront = name == "wavefront";
+    }
+    else if (!strcmp(argv[i], "--no-reorder"))
+    {
+      opts.reorder_rays = false;
+    }
+    else if (!strcmp(argv[i], "--no-packets"))
+    {
+      opts.packets = false;
+    }
+    else if (!strcmp(argv[i], "--pfm"))
+    {
+      opts.pfm = true;
+    }
+    else if (!strcmp(argv[i], "--tonemap") && i + 1 < argc)
+    {
+      tonemap_input = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--expose") && i + 1 < argc)
+    {
+      expose = true;
+      exposure = atof(argv[++i]);
+    }
+    else if (argv[i][0] == '-' || scene_file)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    else
+    {
+      scene_file = argv[i];
+    }
+  }
+
+  // scene_file is the output PNG here
+  if (tonemap_input)
   {
-    scene sc = parse(argv[1]);
-    std::vector<unsigned char> buffer(4 * sc.width * sc.height);
-    render(sc, buffer);
-    lodepng::encode(sc.filename, buffer, sc.width, sc.height);
+    if (!scene_file)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    return tonemap_file(tonemap_input, exposure, scene_file) ? 0 : 1;
+  }
+
+  if (opts.checkpoint.empty())
+  {
+    opts.checkpoint = opts.resume;
+  }
+
+  if (opts.workers && (opts.progressive || opts.time_budget > 0 || !opts.checkpoint.empty()))
+  {
+    cerr << "--workers renders every tile to completion; it can't be combined with "
+         << "progressive, time-budgeted or checkpointed rendering" << endl;
+    return 1;
+  }
+
+  if (scene_file)
+  {
+    scene sc = parse(scene_file);
+    // first touch put the scene in this CPU's node's memory
+    opts.scene_cpu = current_cpu();
+    for (auto v : views(sc))
+    {
+      if (expose)
+        v->expose = exposure;
+      if (!crop)
+        continue;
+      v->crop = true;
+      v->crop_full = crop_full;
+      v->crop_x0 = crop_window[0];
+      v->crop_y0 = crop_window[1];
+      v->crop_x1 = crop_window[2];
+      v->crop_y1 = crop_window[3];
+    }
+    for (auto v : views(sc))
+    {
+      if (!window_valid(*v))
+      {
+        cerr << "crop window " << v->crop_x0 << ' ' << v->crop_y0 << ' ' << v->crop_x1 << ' '
+             << v->crop_y1 << " leaves nothing of the " << v->width << 'x' << v->height
+             << " image of " << v->filename << endl;
+        return 1;
+      }
+    }
+
+    for (auto &name : camera_names)
+    {
+      if (std::none_of(sc.cameras.begin(), sc.cameras.end(),
+                       [&](const auto &cam) { return cam.first == name; }))
+      {
+        cerr << "unknown camera " << name << endl;
+        return 1;
+      }
+    }
+
+    if (server || !server_socket.empty())
+    {
+      // replies go to stdout, so keep progress off it
+      opts.quiet = true;
+      if (server_socket.empty())
+      {
+        serve(sc, opts, cin, cout);
+        return 0;
+      }
+      return serve_socket(sc, opts, server_socket) ? 0 : 1;
+    }
+
+    if (frames[1] >= frames[0])
+    {
+      sc.first_frame = frames[0];
+      sc.last_frame = frames[1];
+    }
+
+    if (sc.last_frame >= sc.first_frame)
+    {
+      // every frame shares the one parsed scene and BVH, and each one is
+      // still encoding while the next renders
+      view base = sc;
+      std::unique_ptr<png_pipeline> encoding;
+      for (int f = sc.first_frame; f <= sc.last_frame; ++f)
+      {
+        static_cast<view &>(sc) = animate(base, sc.keyframes, f);
+        if (!render_next(sc, opts, "frame", std::to_string(f), encoding))
+          return 1;
+      }
+      return encoding && !encoding->finish() ? 1 : 0;
+    }
+
+    if (sc.cameras.empty())
+    {
+      return render_file(sc, opts) ? 0 : 1;
+    }
+
+    // every camera shares the one parsed scene and BVH
+    std::unique_ptr<png_pipeline> encoding;
+    for (auto &[name, v] : sc.cameras)
+    {
+      if (!camera_names.empty() &&
+          std::find(camera_names.begin(), camera_names.end(), name) == camera_names.end())
+        continue;
+
+      static_cast<view &>(sc) = v;
+      if (!render_next(sc, opts, "camera", name, encoding))
+        return 1;
+    }
+    if (encoding && !encoding->finish())
+      return 1;
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <dirent.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "numa.hh"
+
+// parses a sysfs cpu list such as "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list)
+{
+  std::vector<int> cpus;
+  std::istringstream in(list);
+  std::string range;
+  while (std::getline(in, range, ','))
+  {
+    if (range.empty() || range == "\n")
+      continue;
+    auto dash = range.find('-');
+    int lo = std::atoi(range.c_str());
+    int hi = dash == std::string::npos ? lo : std::atoi(range.c_str() + dash + 1);
+    for (int c = lo; c <= hi; ++c)
+      cpus.push_back(c);
+  }
+  return cpus;
+}
+
+std::vector<numa_node> numa_topology()
+{
+  std::vector<numa_node> nodes;
+  const std::string root = "/sys/devices/system/node";
+  if (auto dir = opendir(root.c_str()))
+  {
+    while (auto entry = readdir(dir))
+    {
+      std::string name = entry->d_name;
+      if (name.compare(0, 4, "node") || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != std::string::npos)
+        continue;
+      std::ifstream f(root + "/" + name + "/cpulist");
+      std::string list;
+      if (!std::getline(f, list))
+        continue;
+      auto cpus = parse_cpulist(list);
+      if (!cpus.empty())
+        nodes.push_back({std::atoi(name.c_str() + 4), cpus});
+    }
+    closedir(dir);
+  }
+  std::sort(nodes.begin(), nodes.end(), [](const numa_node &a, const numa_node &b)
+            { return a.id < b.id; });
+
+  if (nodes.empty())
+  {
+    numa_node all{0, {}};
+    for (int c = 0; c < (int)std::max(1u, std::thread::hardware_concurrency()); ++c)
+      all.cpus.push_back(c);
+    nodes.push_back(all);
+  }
+  return nodes;
+}
+
+bool pin_to_cpus(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto c : cpus)
+  {
+    if (c < CPU_SETSIZE)
+      CPU_SET(c, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+int current_cpu()
+{
+#ifdef __linux__
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+numa_layout::numa_layout(scene &sc, int threads, bool replicate, int scene_cpu)
+    : nodes(numa_topology()), node_of(std::max(1, threads)),
+      stats(std::max(1, threads)), original(sc), threads(std::max(1, threads)),
+      replicated(replicate)
+{
+  for (size_t n = 0; n < nodes.size(); ++n)
+  {
+    if (std::find(nodes[n].cpus.begin(), nodes[n].cpus.end(), scene_cpu) != nodes[n].cpus.end())
+      home = n;
+  }
+
+  size_t total = 0;
+  for (auto &n : nodes)
+    total += n.cpus.size();
+
+  // worker w takes the CPU slot w * total / threads, counted across nodes
+  for (int w = 0; w < this->threads; ++w)
+  {
+    size_t slot = w * total / this->threads;
+    int n = 0;
+    while (slot >= nodes[n].cpus.size())
+      slot -= nodes[n++].cpus.size();
+    node_of[w] = n;
+  }
+
+  if (replicate)
+  {
+    // each copy is allocated, and so first touched, by a thread on its node
+    replicas.resize(nodes.size());
+    std::vector<std::thread> builders;
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+      builders.emplace_back([this, n]
+                            {
+                              pin_to_cpus(nodes[n].cpus);
+                              replicas[n] = ::replicate(original);
+                            });
+    }
+    for (auto &b : builders)
+      b.join();
+  }
+
+  placement.group = node_of;
+  placement.setup = [this](int worker)
+  { pin_to_cpus(nodes[node_of[worker]].cpus); };
+}
+
+bool numa_layout::fits(const scene &sc, int threads, bool replicate) const
+{
+  return &sc == &original && std::max(1, threads) == this->threads && replicate == replicated;
+}
+
+void numa_layout::start()
+{
+  for (auto &r : replicas)
+    static_cast<view &>(*r) = original;
+  std::fill(stats.begin(), stats.end(), counters());
+}
+
+scene &numa_layout::scene_for(int worker)
+{
+  if (replicas.empty())
+    return original;
+  return *replicas[node_of[worker]];
+}
+
+void numa_layout::record(int worker, size_t pixels, double seconds)
+{
+  // a replica is always on the worker's own node
+  int remote = !replicated && node_of[worker] != home;
+  auto &s = stats[worker];
+  ++s.tiles[remote];
+  s.pixels[remote] += pixels;
+  s.seconds[remote] += seconds;
+}
+
+void numa_layout::report(std::ostream &out, bool json)
+{
+  for (size_t n = 0; n < nodes.size(); ++n)
+  {
+    counters sum;
+    int workers = 0;
+    for (int w = 0; w < threads; ++w)
+    {
+      if (node_of[w] != (int)n)
+        continue;
+      ++workers;
+      for (int k = 0; k < 2; ++k)
+      {
+        sum.tiles[k] += stats[w].tiles[k];
+        sum.pixels[k] += stats[w].pixels[k];
+        sum.seconds[k] += stats[w].seconds[k];
+      }
+    }
+    if (!workers)
+      continue;
+
+    const char *kind[2] = {"local", "remote"};
+    if (json)
+    {
+      out << "{\"numa_node\":" << nodes[n].id << ",\"workers\":" << workers;
+      for (int k = 0; k < 2; ++k)
+      {
+        out << ",\"" << kind[k] << "_tiles\":" << sum.tiles[k];
+        if (sum.seconds[k] > 0)
+          out << ",\"" << kind[k] << "_mpixels_per_second\":" << sum.pixels[k] / sum.seconds[k] / 1e6;
+      }
+      out << ",\"replicated\":" << (replicated ? "true" : "false")
+          << ",\"holds_scene\":" << (replicated || int(n) == home ? "true" : "false") << "}"
+          << std::endl;
+      continue;
+    }
+
+    out << "node " << nodes[n].id << ": " << workers << " workers";
+    for (int k = 0; k < 2; ++k)
+    {
+      out << ", " << sum.tiles[k] << ' ' << kind[k] << " tiles";
+      if (sum.seconds[k] > 0)
+        out << " (" << sum.pixels[k] / sum.seconds[k] / 1e6 << " Mpixels/s per thread)";
+    }
+    out << (replicated ? ", replicated scene" : int(n) == home ? ", holds the scene" : "")
+        << std::endl;
+  }
+}
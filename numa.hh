@@ -0,0 +1,73 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "scene.hh"
+#include "tiles.hh"
+
+struct numa_node
+{
+  int id;
+  std::vector<int> cpus;
+};
+
+// the machine's NUMA nodes with CPUs, or a single node holding every CPU
+std::vector<numa_node> numa_topology();
+// restricts the calling thread to cpus; false where that isn't supported
+bool pin_to_cpus(const std::vector<int> &cpus);
+// the CPU the calling thread is running on, or -1 where that isn't known
+int current_cpu();
+
+/**
+ * Spreads render workers over the NUMA nodes in proportion to their CPUs and
+ * pins every worker to its node. Consecutive workers share a node, so the
+ * contiguous runs of tiles parallel_tiles seeds them with stay together too.
+ * With replication each node renders from its own copy of the scene, built on
+ * that node so the BVH and textures live in its memory.
+ *
+ * A tile is local when its worker traversed a scene in its own node's memory:
+ * its node's replica, or without replication the original, when the worker
+ * runs on the node that parsed it. Other tiles read the scene remotely. The
+ * report compares how fast the two kinds went.
+ *
+ * Replicating is slow, so a layout is meant to be kept for all the renders of
+ * a scene; start() readies it for the next one.
+ */
+class numa_layout
+{
+  struct alignas(64) counters
+  {
+    size_t tiles[2] = {0, 0}, pixels[2] = {0, 0};
+    double seconds[2] = {0, 0};
+  };
+
+  std::vector<numa_node> nodes;
+  // per worker: index into nodes
+  std::vector<int> node_of;
+  // per node, empty without replication
+  std::vector<std::unique_ptr<scene>> replicas;
+  std::vector<counters> stats;
+  scene &original;
+  int threads;
+  bool replicated;
+  // the node whose memory holds the original
+  int home = 0;
+
+public:
+  worker_placement placement;
+
+  // scene_cpu is the CPU sc was parsed on, or -1 when unknown, taken as the
+  // first node's
+  numa_layout(scene &sc, int threads, bool replicate, int scene_cpu);
+  // whether this layout is the one to render sc with these settings
+  bool fits(const scene &sc, int threads, bool replicate) const;
+  // brings the replicas up to date with the original's view, which changes
+  // between frames, cameras and requests, and clears the counters
+  void start();
+  scene &scene_for(int worker);
+  // accounts for a tile rendered by worker
+  void record(int worker, size_t pixels, double seconds);
+  // a line per node, or a JSON object per line with json
+  void report(std::ostream &out, bool json = false);
+};
@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "png.hh"
+
+// deflate output is cut into IDAT chunks of this size
+static const size_t chunk_size = 1 << 16;
+
+static void put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+png_writer::png_writer(const std::string &filename, unsigned width, unsigned height)
+    : filename(filename), tmp(filename + ".part"), width(width), height(height),
+      prev(4 * width), filtered(4 * width + 1), best(4 * width + 1), out(chunk_size)
+{
+  std::memset(&z, 0, sizeof(z));
+  if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
+    return;
+  deflating = true;
+  z.avail_out = chunk_size;
+  if (!(f = std::fopen(tmp.c_str(), "wb")))
+    return;
+
+  static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  unsigned char ihdr[13];
+  put32(ihdr, width);
+  put32(ihdr + 4, height);
+  ihdr[8] = 8;  // bits per channel
+  ihdr[9] = 6;  // RGBA
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // not interlaced
+  ok = std::fwrite(signature, 1, 8, f) == 8 && chunk("IHDR", ihdr, sizeof(ihdr));
+}
+
+png_writer::~png_writer()
+{
+  if (deflating)
+    deflateEnd(&z);
+  if (f)
+  {
+    std::fclose(f);
+    std::remove(tmp.c_str());
+  }
+}
+
+bool png_writer::chunk(const char *type, const unsigned char *data, size_t n)
+{
+  unsigned char head[8], tail[4];
+  put32(head, n);
+  std::memcpy(head + 4, type, 4);
+  auto crc = crc32(0, head + 4, 4);
+  if (n)
+    crc = crc32(crc, data, n);
+  put32(tail, crc);
+  return std::fwrite(head, 1, 8, f) == 8 && std::fwrite(data, 1, n, f) == n &&
+         std::fwrite(tail, 1, 4, f) == 4;
+}
+
+// runs deflate over whatever input is pending, writing every full chunk
+bool png_writer::flush(int mode)
+{
+  for (;;)
+  {
+    z.next_out = out.data() + (chunk_size - z.avail_out);
+    int status = deflate(&z, mode);
+    if (status == Z_STREAM_ERROR)
+      return false;
+    if (!z.avail_out)
+    {
+      if (!chunk("IDAT", out.data(), chunk_size))
+        return false;
+      z.avail_out = chunk_size;
+      continue;
+    }
+    if (mode == Z_FINISH && status != Z_STREAM_END)
+      continue;
+    return true;
+  }
+}
+
+bool png_writer::write_row(const unsigned char *rgba)
+{
+  if (!ok || rows >= height)
+    return false;
+
+  // the filter with the smallest sum of absolute differences, as libpng does
+  size_t n = 4 * width;
+  long best_cost = -1;
+  for (unsigned char type = 0; type < 5; ++type)
+  {
+    filtered[0] = type;
+    long cost = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      int a = i >= 4 ? rgba[i - 4] : 0, b = rows ? prev[i] : 0,
+          c = i >= 4 && rows ? prev[i - 4] : 0, pred = 0;
+      switch (type)
+      {
+      case 1:
+        pred = a;
+        break;
+      case 2:
+        pred = b;
+        break;
+      case 3:
+        pred = (a + b) / 2;
+        break;
+      case 4:
+      {
+        int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        pred = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        break;
+      }
+      }
+      unsigned char v = rgba[i] - pred;
+      filtered[i + 1] = v;
+      cost += v < 128 ? v : 256 - v;
+    }
+    if (best_cost < 0 || cost < best_cost)
+    {
+      best_cost = cost;
+      std::swap(filtered, best);
+    }
+  }
+  std::copy_n(rgba, n, prev.begin());
+  ++rows;
+
+  z.next_in = best.data();
+  z.avail_in = n + 1;
+  return ok = flush(Z_NO_FLUSH);
+}
+
+bool png_writer::finish()
+{
+  if (!ok || rows != height || !flush(Z_FINISH))
+    return false;
+  if (z.avail_out < chunk_size && !chunk("IDAT", out.data(), chunk_size - z.avail_out))
+    return false;
+  if (!chunk("IEND", nullptr, 0))
+    return false;
+  bool closed = !std::fclose(f);
+  f = nullptr;
+  if (!closed || std::rename(tmp.c_str(), filename.c_str()))
+  {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool write_png(const std::string &filename, const std::vector<unsigned char> &image,
+               unsigned width, unsigned height)
+{
+  png_writer out(filename, width, height);
+  for (unsigned i = 0; i < height; ++i)
+  {
+    if (!out.write_row(&image[4 * i * width]))
+      return false;
+  }
+  return out.finish();
+}
+
+png_pipeline::png_pipeline(const std::string &filename, tile win, int x0, int y0,
+                           unsigned width, unsigned height)
+    : filename(filename), win(win), x0(x0), y0(y0), width(width), height(height),
+      filled(std::max(0, win.y1 - win.y0)),
+      image(4 * std::max(0, win.x1 - win.x0) * std::max(0, win.y1 - win.y0))
+{
+  encoder = std::thread([this]
+                        { encode(); });
+}
+
+png_pipeline::~png_pipeline()
+{
+  if (encoder.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      cancelled = true;
+    }
+    wake.notify_one();
+    encoder.join();
+  }
+}
+
+bool png_pipeline::row_ready(int r)
+{
+  return complete || filled[r].load(std::memory_order_acquire) == win.x1 - win.x0;
+}
+
+void png_pipeline::tile_done(const tile &t)
+{
+  bool any = false;
+  for (int i = t.y0; i < t.y1; ++i)
+  {
+    int w = t.x1 - t.x0;
+    if (filled[i - win.y0].fetch_add(w, std::memory_order_acq_rel) + w == win.x1 - win.x0)
+      any = true;
+  }
+  if (any)
+  {
+    std::lock_guard<std::mutex> lock(m);
+    wake.notify_one();
+  }
+}
+
+void png_pipeline::encode()
+{
+  std::vector<unsigned char> row(4 * width);
+  int w = win.x1 - win.x0;
+  // the window columns that land in the output
+  int from = std::max(win.x0, x0), to = std::min<int>(win.x1, x0 + width);
+
+  // the file is only opened once there are pixels for it, so progressive
+  // snapshots of the same file can come and go until then
+  {
+    std::unique_lock<std::mutex> lock(m);
+    wake.wait(lock, [&]
+              { return cancelled || complete || (!filled.empty() && row_ready(0)); });
+    if (cancelled)
+      return;
+  }
+  png_writer out(filename, width, height);
+
+  for (unsigned r = 0; r < height && ok; ++r)
+  {
+    int i = y0 + r;
+    bool inside = i >= win.y0 && i < win.y1 && from < to;
+    if (inside)
+    {
+      std::unique_lock<std::mutex> lock(m);
+      wake.wait(lock, [&]
+                { return cancelled || row_ready(i - win.y0); });
+      if (cancelled)
+        return;
+    }
+
+    const unsigned char *p = row.data();
+    if (inside && from == x0 && to - from == int(width))
+    {
+      p = &image[4 * ((i - win.y0) * w + from - win.x0)];
+    }
+    else
+    {
+      std::fill(row.begin(), row.end(), 0);
+      if (inside)
+        std::copy_n(&image[4 * ((i - win.y0) * w + from - win.x0)], 4 * (to - from),
+                    &row[4 * (from - x0)]);
+    }
+    ok = out.write_row(p);
+  }
+
+  std::unique_lock<std::mutex> lock(m);
+  wake.wait(lock, [&]
+            { return complete || cancelled; });
+  if (cancelled)
+    return;
+  ok = ok && out.finish();
+}
+
+bool png_pipeline::finish()
+{
+  {
+    std::lock_guard<std::mutex> lock(m);
+    complete = true;
+  }
+  wake.notify_one();
+  encoder.join();
+  if (!ok)
+    std::cerr << "cannot write " << filename << std::endl;
+  return ok;
+}
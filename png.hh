@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "tiles.hh"
+
+/**
+ * Writes an 8-bit RGBA PNG a row at a time: every row is filtered and fed to
+ * deflate as it arrives, so nothing waits for the whole image. The file is
+ * written under a temporary name and renamed by finish, so viewers never see
+ * a half-written image; a writer destroyed before that removes it again.
+ */
+class png_writer
+{
+  std::string filename, tmp;
+  FILE *f = nullptr;
+  z_stream z;
+  bool ok = false, deflating = false;
+  unsigned width, height, rows = 0;
+  std::vector<unsigned char> prev, filtered, best, out;
+
+  bool chunk(const char *type, const unsigned char *data, size_t n);
+  bool flush(int mode);
+
+public:
+  png_writer(const std::string &filename, unsigned width, unsigned height);
+  ~png_writer();
+  png_writer(const png_writer &) = delete;
+  png_writer &operator=(const png_writer &) = delete;
+
+  // takes 4 * width bytes
+  bool write_row(const unsigned char *rgba);
+  // after the last row
+  bool finish();
+};
+
+// writes a whole RGBA image of width x height pixels
+bool write_png(const std::string &filename, const std::vector<unsigned char> &image,
+               unsigned width, unsigned height);
+
+/**
+ * Encodes an image on a thread of its own while it is still being rendered.
+ * The renderer fills image, which holds just the rendered window, and calls
+ * tile_done for every tile whose pixels are final; each output row is written
+ * as soon as all of it is. Output rows and columns outside the window are
+ * transparent, which is how a full-frame image of a crop gets its padding.
+ */
+class png_pipeline
+{
+  std::string filename;
+  tile win;
+  int x0, y0;
+  unsigned width, height;
+  // pixels of each window row that are final
+  std::vector<std::atomic<int>> filled;
+
+  std::mutex m;
+  std::condition_variable wake;
+  bool complete = false, cancelled = false, ok = true;
+  std::thread encoder;
+
+  void encode();
+  bool row_ready(int r);
+
+public:
+  std::vector<unsigned char> image;
+
+  // the output is width x height pixels, its top left corner at (x0, y0) in
+  // image coordinates
+  png_pipeline(const std::string &filename, tile win, int x0, int y0,
+               unsigned width, unsigned height);
+  // drops an unfinished image
+  ~png_pipeline();
+
+  void tile_done(const tile &t);
+  // marks the whole image final and waits for the encoder; false, after
+  // saying why, when the file couldn't be written
+  bool finish();
+};
@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include "progress.hh"
+
+progress_reporter::progress_reporter(int workers, uint64_t pixels, uint64_t total_work,
+                                     float interval, bool json, float budget)
+    : workers(std::max(1, workers)), pixels(std::max<uint64_t>(1, pixels)),
+      total_work(std::max<uint64_t>(1, total_work)), budget(budget),
+      interval(interval > 0 ? interval : 1), json(json),
+      start(clock::now())
+{
+  reporter = std::thread([this]
+                         {
+                           std::unique_lock<std::mutex> lock(m);
+                           auto period = std::chrono::duration<float>(this->interval);
+                           while (!wake.wait_for(lock, period, [this]
+                                                 { return stopping; }))
+                             report(false);
+                         });
+}
+
+progress_reporter::~progress_reporter()
+{
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stopping = true;
+  }
+  wake.notify_one();
+  reporter.join();
+  report(true);
+}
+
+void progress_reporter::report(bool final)
+{
+  uint64_t work = 0, samples = 0, rays = 0;
+  for (auto &c : workers)
+  {
+    work += c.work.load(std::memory_order_relaxed);
+    samples += c.samples.load(std::memory_order_relaxed);
+    rays += c.rays.load(std::memory_order_relaxed);
+  }
+
+  auto now = clock::now();
+  // counters only move once per tile, so a rate over one interval is lumpy
+  std::chrono::duration<float> elapsed = now - start;
+  float rate = elapsed.count() > 0 ? rays / elapsed.count() : 0;
+
+  float done = budget > 0 ? elapsed.count() / budget : float(work) / total_work;
+  done = final ? 1 : std::min(1.0f, done);
+  float eta = done > 0 ? elapsed.count() * (1 - done) / done
+                       : std::numeric_limits<float>::infinity();
+  if (budget > 0)
+    eta = std::max(0.0f, budget - elapsed.count());
+  float spp = float(samples) / pixels;
+  int k = pass.load(std::memory_order_relaxed), n = passes.load(std::memory_order_relaxed);
+
+  if (json)
+  {
+    std::cout << "{\"elapsed\":" << elapsed.count() << ",\"progress\":" << done
+              << ",\"rays_per_second\":" << rate << ",\"samples_per_pixel\":" << spp;
+    if (eta != std::numeric_limits<float>::infinity())
+      std::cout << ",\"eta\":" << eta;
+    if (k)
+      std::cout << ",\"pass\":" << k;
+    std::cout << ",\"done\":" << (final ? "true" : "false") << "}" << std::endl;
+    return;
+  }
+
+  std::cout << "progress: " << std::fixed << std::setprecision(1) << 100 * done << "% "
+            << std::setprecision(2) << rate / 1e6 << " Mrays/s "
+            << spp << " spp";
+  if (final)
+    std::cout << " in " << std::setprecision(1) << elapsed.count() << 's';
+  else if (eta != std::numeric_limits<float>::infinity())
+    std::cout << " eta " << std::setprecision(0) << eta << 's';
+  if (k && n)
+    std::cout << " (pass " << k << '/' << n << ')';
+  else if (k)
+    std::cout << " (pass " << k << ')';
+  std::cout << std::defaultfloat << std::setprecision(6) << "    " << (final ? '\n' : '\r')
+            << std::flush;
+}
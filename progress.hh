@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Reports how far a render has got from a thread of its own, so workers never
+ * touch a stream or a lock. Every worker bumps its own cache-line sized
+ * counters once per tile; the reporter sums them every interval and prints
+ * percent complete, rays per second, samples per pixel and the time left,
+ * either as one rewritten status line or as a JSON object per line.
+ *
+ * Progress is work done out of total_work, whatever unit the caller counts
+ * in, or the share of the time budget used up when there is one.
+ */
+class progress_reporter
+{
+  struct alignas(64) counters
+  {
+    std::atomic<uint64_t> work{0}, samples{0}, rays{0};
+  };
+
+  std::vector<counters> workers;
+  uint64_t pixels, total_work;
+  float budget, interval;
+  bool json;
+  std::atomic<int> pass{0}, passes{0};
+
+  using clock = std::chrono::steady_clock;
+  clock::time_point start;
+
+  std::mutex m;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread reporter;
+
+  void report(bool final);
+
+public:
+  progress_reporter(int workers, uint64_t pixels, uint64_t total_work,
+                    float interval, bool json, float budget = 0);
+  // prints the final state
+  ~progress_reporter();
+
+  // called by worker after each piece of work
+  void add(int worker, uint64_t work, uint64_t samples, uint64_t rays)
+  {
+    auto &c = workers[worker];
+    c.work.fetch_add(work, std::memory_order_relaxed);
+    c.samples.fetch_add(samples, std::memory_order_relaxed);
+    c.rays.fetch_add(rays, std::memory_order_relaxed);
+  }
+  // the progressive pass under way, counting from 1
+  void set_pass(int k, int n)
+  {
+    pass.store(k, std::memory_order_relaxed);
+    passes.store(n, std::memory_order_relaxed);
+  }
+};
@@ -1,38 +1,42 @@
 #include <iostream>
-#include <random>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <limits>
+#include <atomic>
+#include <mutex>
 #include <utility>
+#include <vector>
+#include "distributed.hh"
+#include "framebuffer.hh"
+#include "integrator.hh"
+#include "numa.hh"
+#include "png.hh"
+#include "progress.hh"
 #include "render.hh"
+#include "rng.hh"
+#include "tiles.hh"
+#include "wavefront.hh"
 
-std::default_random_engine gen;
-std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
-
-float gamma(float l, float exposure)
-{
-  l = std::clamp(l, 0.0f, 1.0f);
-  if (exposure)
-  {
-    l = 1 - std::exp(-l * exposure);
-  }
-  return l <= 0.0031308 ? 12.92 * l : 1.055 * std::pow(l, 1 / 2.4) - 0.055;
-}
-
-vec sample_unit_disk()
+vec sample_unit_disk(rng &r)
 {
   vec q;
   do
   {
-    q = vec(2 * uniform(gen) - 1, 2 * uniform(gen) - 1, 0);
+    q = vec(2 * r.uniform() - 1, 2 * r.uniform() - 1, 0);
   } while (q.norm() >= 1);
   return q;
 }
 
-vec sample_unit_sphere()
+vec sample_unit_sphere(rng &r)
 {
   vec q;
   do
   {
-    q = vec(2 * uniform(gen) - 1, 2 * uniform(gen) - 1, 2 * uniform(gen) - 1);
+    q = vec(2 * r.uniform() - 1, 2 * r.uniform() - 1, 2 * r.uniform() - 1);
   } while (q.norm() >= 1);
   return q;
 }
@@ -47,16 +51,144 @@ struct ray_trace_result
       : obj_hit(obj), p(p), intensity(c){};
 };
 
-vec illuminate(scene &sc, light &light, object *obj, vec p, vec n)
+// per thread, so counting a ray costs no more than an increment
+thread_local uint64_t rays_traced = 0;
+
+uint64_t take_rays()
+{
+  auto n = rays_traced;
+  rays_traced = 0;
+  return n;
+}
+
+/**
+ * The object that last blocked each of the scene's lights, per thread. The
+ * next shading point is usually shadowed by the same one, which a single
+ * intersection test then shows without walking the BVH. It only lives for a
+ * tile, so it never outlives the scene its objects belong to.
+ */
+struct occluder_cache
+{
+  std::vector<object *> last;
+  // shadow rays found blocked and those the cached object answered, per
+  // light
+  std::vector<uint64_t> blocked, hits;
+};
+
+static thread_local occluder_cache occluders;
+
+// the counts of all tiles of the render under way
+static std::mutex occluder_mutex;
+static std::vector<uint64_t> occluder_blocked, occluder_hits;
+
+// adds the calling thread's counts to the render's and empties its cache
+static void release_occluders()
+{
+  auto &c = occluders;
+  if (c.last.empty())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(occluder_mutex);
+    if (occluder_blocked.size() < c.blocked.size())
+    {
+      occluder_blocked.resize(c.blocked.size());
+      occluder_hits.resize(c.blocked.size());
+    }
+    for (size_t l = 0; l < c.blocked.size(); ++l)
+    {
+      occluder_blocked[l] += c.blocked[l];
+      occluder_hits[l] += c.hits[l];
+    }
+  }
+  c.last.clear();
+  c.blocked.clear();
+  c.hits.clear();
+}
+
+static void reset_occluder_stats()
+{
+  std::lock_guard<std::mutex> lock(occluder_mutex);
+  occluder_blocked.clear();
+  occluder_hits.clear();
+}
+
+// a line of hit rates, or with json every light's counts in one JSON object
+static void report_occluders(std::ostream &out, bool json)
 {
+  std::lock_guard<std::mutex> lock(occluder_mutex);
+  if (occluder_blocked.empty())
+    return;
+  if (json)
+  {
+    out << "{\"shadow_cache\":[";
+    for (size_t l = 0; l < occluder_blocked.size(); ++l)
+      out << (l ? "," : "") << "{\"light\":" << l + 1 << ",\"blocked\":" << occluder_blocked[l]
+          << ",\"hits\":" << occluder_hits[l] << "}";
+    out << "]}" << std::endl;
+    return;
+  }
+  out << "shadow cache hits:";
+  // one figure for all of them, once there are too many to list
+  if (occluder_blocked.size() > 8)
+  {
+    uint64_t blocked = 0, hits = 0;
+    for (size_t l = 0; l < occluder_blocked.size(); ++l)
+    {
+      blocked += occluder_blocked[l];
+      hits += occluder_hits[l];
+    }
+    float rate = blocked ? 100.0f * hits / blocked : 0;
+    out << ' ' << std::fixed << std::setprecision(1) << rate << "% of " << blocked
+        << " blocked, " << occluder_blocked.size() << " lights" << std::defaultfloat
+        << std::setprecision(6) << std::endl;
+    return;
+  }
+  for (size_t l = 0; l < occluder_blocked.size(); ++l)
+  {
+    float rate = occluder_blocked[l] ? 100.0f * occluder_hits[l] / occluder_blocked[l] : 0;
+    out << (l ? ", " : " ") << "light " << l + 1 << ' ' << std::fixed << std::setprecision(1)
+        << rate << "% of " << occluder_blocked[l] << " blocked" << std::defaultfloat
+        << std::setprecision(6);
+  }
+  out << std::endl;
+}
+
+vec illuminate(scene &sc, light &light, object *obj, vec p, vec n, int index)
+{
+  ++rays_traced;
   auto l_dir = light.dir(p);
   auto l_dist = light.dist(p);
 
-  auto [obj_hit, t_hit] = sc.objects.intersect(p, l_dir);
-
-  if (obj_hit && t_hit < l_dist) // in shadow
+  if (index < 0)
+  {
+    if (sc.objects.occluded(p, l_dir, l_dist)) // in shadow
+      return vec();
+  }
+  else
   {
-    return vec();
+    auto &c = occluders;
+    if (c.last.size() <= size_t(index))
+    {
+      c.last.resize(index + 1);
+      c.blocked.resize(index + 1);
+      c.hits.resize(index + 1);
+    }
+    if (auto *last = c.last[index])
+    {
+      // offset as in bvh_node::intersect
+      auto t = last->intersect(p + 1e-3 * l_dir, l_dir);
+      if (t > 0 && t < l_dist)
+      {
+        ++c.blocked[index];
+        ++c.hits[index];
+        return vec();
+      }
+    }
+    if ((c.last[index] = sc.objects.occluded(p, l_dir, l_dist)))
+    {
+      ++c.blocked[index];
+      return vec();
+    }
   }
 
   auto lambert = std::max(.0f, l_dir.dot(n));
@@ -64,142 +196,705 @@ vec illuminate(scene &sc, light &light, object *obj, vec p, vec n)
   return color.clamp();
 }
 
-ray_trace_result ray_trace(scene &sc, vec o, vec dir, int d, int bounces)
+void choose_lights(scene &sc, vec p, vec n, rng &gen, std::vector<light_choice> &chosen)
+{
+  auto &tree = sc.sampled_lights;
+  if (!sc.light_samples || tree.empty())
+  {
+    for (size_t l = 0; l < sc.lights.size(); ++l)
+      chosen.push_back({int(l), 1});
+    return;
+  }
+
+  for (auto l : tree.unsampled())
+    chosen.push_back({l, 1});
+  for (int k = 0; k < sc.light_samples; ++k)
+  {
+    int index;
+    float pdf;
+    if (tree.sample(p, n, gen.uniform(), index, pdf))
+      chosen.push_back({index, 1 / (sc.light_samples * pdf)});
+  }
+}
+
+// a ray still to be traced, and the share of its color that reaches the result
+struct pending_ray
 {
-  auto [obj_hit, t_hit] = sc.objects.intersect(o, dir);
+  vec o, dir, weight;
+  int bounces;
+  rng gen;
+};
 
-  if (!obj_hit)
+/**
+ * The rays one ray_trace call still has to follow, in a fixed array. They are
+ * traced depth first, so the stack only grows by one entry per bounce level;
+ * rays past max_pending levels are dropped.
+ */
+class ray_stack
+{
+  static const int max_pending = 64;
+  // uninitialized until pushed
+  union slot
+  {
+    pending_ray ray;
+    slot(){};
+  };
+  std::array<slot, max_pending> slots;
+  int top = 0;
+
+public:
+  bool empty() { return !top; }
+  void push(const pending_ray &ray)
   {
-    return ray_trace_result();
+    if (top < max_pending)
+      slots[top++].ray = ray;
   }
+  pending_ray pop() { return slots[--top].ray; }
+};
 
-  auto p = o + t_hit * dir;
-  auto n = obj_hit->norm_at(p);
+/**
+ * Whether light reaching the pixel with this weight is worth tracing. Zero
+ * weights never are. Below sc.roulette, a ray survives with probability
+ * proportional to its weight and has its weight raised to match, so on
+ * average the result is the same while most of those rays are never traced.
+ */
+bool keep_ray(scene &sc, vec &weight, rng &gen)
+{
+  float m = std::max({std::abs(weight.x), std::abs(weight.y), std::abs(weight.z)});
+  if (m <= 0)
+    return false;
+  if (m >= sc.roulette)
+    return true;
+  float q = m / sc.roulette;
+  if (gen.uniform() >= q)
+    return false;
+  weight = weight / q;
+  return true;
+}
 
+/**
+ * The shading both integrators do at a hit, in the order they draw from gen:
+ * the roughness jitter of the normal, roulette for the diffuse share, the
+ * lights to shade it with, the indirect direction, then roulette for the
+ * refracted share, unless it is totally internally reflected, and for the
+ * reflected one.
+ */
+void shade_hit(scene &sc, object *obj, vec p, vec dir, vec weight, int d, int bounces, rng &gen,
+               std::vector<light_choice> &chosen, hit_shading &hit)
+{
+  auto n = obj->norm_at(p);
   // use the other side
   if (n.dot(dir) > 0)
     n = -n;
 
-  if (obj_hit->roughness)
+  if (obj->roughness)
   {
-    std::normal_distribution<float> gaussian(0.0, obj_hit->roughness);
-    n.x += gaussian(gen);
-    n.y += gaussian(gen);
-    n.z += gaussian(gen);
+    n.x += gen.gaussian(obj->roughness);
+    n.y += gen.gaussian(obj->roughness);
+    n.z += gen.gaussian(obj->roughness);
   }
+  hit.n = n;
 
-  vec diffuse, refraction, reflection;
-
-  for (auto &l : sc.lights)
+  auto s = obj->shininess, t = obj->transparency;
+  hit.lit = weight * (vec(1, 1, 1) - s) * (vec(1, 1, 1) - t);
+  if (keep_ray(sc, hit.lit, gen))
   {
-    diffuse += illuminate(sc, *l, obj_hit, p, n);
+    hit.diffuse = true;
+    choose_lights(sc, p, n, gen, chosen);
+    if (d)
+    {
+      hit.indirect = true;
+      hit.indirect_dir = (n + sample_unit_sphere(gen)).normalize();
+    }
   }
 
-  if (d)
+  if (!bounces)
+    return;
+
+  auto reflected = weight * s, refracted = weight * (vec(1, 1, 1) - s) * t;
+
+  // refraction
+  bool entering = dir.dot(obj->norm_at(p)) < 0;
+  auto eta = entering ? 1 / obj->ior : obj->ior;
+  float k = 1.0 - std::pow(eta, 2) * (1 - n.dot(dir) * n.dot(dir));
+  if (k < 0)
   {
-    // shoot secondary rays
-    auto random_dir = (n + sample_unit_sphere()).normalize();
-    auto res = ray_trace(sc, p, random_dir, d - 1, bounces);
-    if (res.obj_hit)
-    {
-      point_light l(res.p, res.intensity);
-      diffuse += illuminate(sc, l, obj_hit, p, n);
-    }
+    // total internal reflection: the refracted share is reflected too
+    reflected += refracted;
+  }
+  else if (keep_ray(sc, refracted, gen))
+  {
+    auto r = (eta * dir - (eta * n.dot(dir) + std::sqrt(k)) * n).normalize();
+    hit.rays[hit.count++] = {p + 0.001 * r, r, refracted, 2};
   }
 
-  if (bounces)
+  // reflection
+  if (keep_ray(sc, reflected, gen))
   {
-    // reflection
     auto r = (dir - 2 * dir.dot(n) * n).normalize();
-    auto res = ray_trace(sc, p, r, d, bounces - 1);
-    reflection = res.intensity;
+    hit.rays[hit.count++] = {p, r, reflected, 1};
   }
+}
 
-  if (bounces)
+/**
+ * Traces a ray and everything it reflects and refracts into, iteratively:
+ * each hit adds its weighted diffuse light to the color and pushes its
+ * reflection and refraction rays, weighted by how much of them shows up in
+ * this ray's color. Indirect light is different, as a diffuse hit lights this
+ * one like a point light whose contribution is clamped; it still takes a
+ * nested call, d levels deep at most. With first_hit, the ray's own
+ * intersection is taken from there instead.
+ */
+ray_trace_result ray_trace(scene &sc, vec o, vec dir, int d, int bounces, rng gen,
+                           const std::pair<object *, float> *first_hit = nullptr)
+{
+  ray_trace_result result;
+  ray_stack stack;
+  stack.push({o, dir, vec(1, 1, 1), bounces, gen});
+  bool first = true;
+
+  while (!stack.empty())
   {
-    // refraction
-    bool entering = dir.dot(obj_hit->norm_at(p)) < 0;
-    auto eta = entering ? 1 / obj_hit->ior : obj_hit->ior;
-    float k = 1.0 - std::pow(eta, 2) * (1 - n.dot(dir) * n.dot(dir));
-    if (k < 0)
+    auto ray = stack.pop();
+    ++rays_traced;
+    // the first ray's hit may have been found already, in a packet
+    std::pair<object *, float> found;
+    if (first_hit)
+      found = *first_hit;
+    else
+      found = sc.objects.intersect(ray.o, ray.dir);
+    first_hit = nullptr;
+    auto [obj_hit, t_hit] = found;
+
+    if (!obj_hit)
     {
-      refraction = reflection;
+      first = false;
+      continue;
     }
-    else
+
+    auto p = ray.o + t_hit * ray.dir;
+    if (first)
     {
-      auto r = (eta * dir - (eta * n.dot(dir) + std::sqrt(k)) * n).normalize();
-      auto res = ray_trace(sc, p + 0.001 * r, r, d, bounces - 1);
-      refraction = res.intensity;
+      result.obj_hit = obj_hit;
+      result.p = p;
+      first = false;
     }
-  }
 
-  auto s = obj_hit->shininess, t = obj_hit->transparency;
-  auto color = s * reflection +
-               (vec(1, 1, 1) - s) * t * refraction +
-               (vec(1, 1, 1) - s) * (vec(1, 1, 1) - t) * diffuse;
+    hit_shading hit;
+    // used up before the nested call below needs it again
+    static thread_local std::vector<light_choice> chosen;
+    chosen.clear();
+    shade_hit(sc, obj_hit, p, ray.dir, ray.weight, d, ray.bounces, ray.gen, chosen, hit);
+    if (hit.diffuse)
+    {
+      vec diffuse;
+      for (auto [l, weight] : chosen)
+      {
+        diffuse += weight * illuminate(sc, *sc.lights[l], obj_hit, p, hit.n, l);
+      }
+
+      if (hit.indirect)
+      {
+        // shoot secondary rays
+        auto res = ray_trace(sc, p, hit.indirect_dir, d - 1, ray.bounces, ray.gen.split(0));
+        if (res.obj_hit)
+        {
+          point_light l(res.p, res.intensity);
+          diffuse += illuminate(sc, l, obj_hit, p, hit.n);
+        }
+      }
+      result.intensity += hit.lit * diffuse;
+    }
+
+    for (int k = 0; k < hit.count; ++k)
+    {
+      auto &r = hit.rays[k];
+      stack.push({r.o, r.dir, r.weight, ray.bounces - 1, ray.gen.split(r.branch)});
+    }
+  }
 
-  return {obj_hit, p, color};
+  return result;
 }
 
-void render(scene &sc, std::vector<unsigned char> &image)
+bool camera_ray(scene &sc, int i, int j, rng &gen, vec &origin, vec &dir)
 {
   float w = sc.width, h = sc.height;
+  auto forward = sc.forward;
+  origin = sc.eye;
+
+  float x = j + gen.uniform(), y = i + gen.uniform();
+  float sx = (2 * x - w) / std::max(w, h);
+  float sy = float(h - 2 * y) / std::max(w, h);
+
+  if (sc.fisheye)
+  {
+    sx /= sc.forward.norm();
+    sy /= sc.forward.norm();
+    float r2 = (sx * sx + sy * sy);
+    if (r2 > 1)
+      return false;
+    forward = std::sqrt(1 - r2) * (forward.normalize());
+  }
+
+  dir = (forward + sx * sc.right + sy * sc.up).normalize();
 
-  for (int i = 0; i < sc.height; ++i)
+  if (sc.dof)
   {
-    for (int j = 0; j < sc.width; ++j)
+    auto focal_point = sc.eye + sc.focus * dir;
+    auto offset = sc.lens * sample_unit_disk(gen);
+    origin += offset.x * sc.right + offset.y * sc.up;
+    dir = (focal_point - origin).normalize();
+  }
+  return true;
+}
+
+// traces sample k of pixel (i, j); returns whether the sample hit anything
+bool sample_pixel(scene &sc, int i, int j, int k, vec &c)
+{
+  rng gen(i * sc.width + j, k);
+  vec origin, dir;
+  if (!camera_ray(sc, i, j, gen, origin, dir))
+    return false;
+  auto res = ray_trace(sc, origin, dir, sc.d, sc.bounces, gen.split(0));
+  c = res.intensity;
+  return res.obj_hit;
+}
+
+/**
+ * The next sample, below limit, of each pixel of run, at most ray_packet::size
+ * of them, that needs one, with their camera rays intersected as one packet.
+ * Each sample is the one sample_pixel would take. Returns how many it took.
+ */
+static size_t sample_packet(scene &sc, framebuffer &fb, const std::vector<std::pair<int, int>> &run,
+                            int limit)
+{
+  ray_packet packet;
+  std::pair<int, int> pixels[ray_packet::size];
+  static thread_local std::vector<rng> gens;
+  gens.clear();
+  size_t taken = 0;
+  for (auto [i, j] : run)
+  {
+    auto p = fb.index(i, j);
+    if (!needs_sample(sc, limit, fb.samples[p], luminance(fb.sum[p]), fb.sum2[p]))
+      continue;
+    ++taken;
+    rng gen(i * sc.width + j, fb.samples[p]);
+    vec o, dir;
+    if (!camera_ray(sc, i, j, gen, o, dir))
     {
-      bool hit_any = false;
-      vec c;
+      fb.add(i, j, vec(), false);
+      continue;
+    }
+    pixels[packet.count] = {i, j};
+    gens.push_back(gen.split(0));
+    packet.add(o, dir);
+  }
+  if (!packet.count)
+    return taken;
 
-      // randomly sample rays in a pixel
-      for (int k = 0; k < sc.aa; ++k)
-      {
-        auto origin = sc.eye;
-        auto forward = sc.forward;
+  object *obj_hit[ray_packet::size];
+  float t_hit[ray_packet::size];
+  sc.objects.intersect(packet, obj_hit, t_hit);
+  for (int m = 0; m < packet.count; ++m)
+  {
+    std::pair<object *, float> first_hit(obj_hit[m], t_hit[m]);
+    auto res = ray_trace(sc, packet.origin(m), packet.dir(m), sc.d, sc.bounces, gens[m], &first_hit);
+    fb.add(pixels[m].first, pixels[m].second, res.intensity, res.obj_hit);
+  }
+  return taken;
+}
 
-        float x = j + uniform(gen), y = i + uniform(gen);
-        float sx = (2 * x - w) / std::max(w, h);
-        float sy = float(h - 2 * y) / std::max(w, h);
+// whether a pixel that has taken n samples so far should take another, given
+bool needs_sample(scene &sc, int limit, int n, float sum, float sum2)
+{
+  if (n >= limit)
+    return false;
+  if (!sc.adaptive || n < sc.min_samples)
+    return true;
+  float mean = sum / n;
+  float var = std::max(0.0f, (sum2 - n * mean * mean) / (n - 1));
+  return std::sqrt(var / n) > sc.threshold;
+}
 
-        if (sc.fisheye)
-        {
-          sx /= sc.forward.norm();
-          sy /= sc.forward.norm();
-          float r2 = (sx * sx + sy * sy);
-          if (r2 > 1)
-            continue;
-          forward = std::sqrt(1 - r2) * (forward.normalize());
-        }
+int max_samples(scene &sc)
+{
+  return sc.adaptive ? sc.max_samples : sc.aa;
+}
 
-        auto dir = (forward + sx * sc.right + sy * sc.up).normalize();
+tile window(const view &v)
+{
+  if (!v.crop)
+    return {0, 0, v.width, v.height};
+  return {std::clamp(v.crop_x0, 0, v.width), std::clamp(v.crop_y0, 0, v.height),
+          std::clamp(v.crop_x1, 0, v.width), std::clamp(v.crop_y1, 0, v.height)};
+}
 
-        if (sc.dof)
-        {
-          auto focal_point = sc.eye + sc.focus * dir;
-          auto offset = sc.lens * sample_unit_disk();
-          origin += offset.x * sc.right + offset.y * sc.up;
-          dir = (focal_point - origin).normalize();
-        }
+bool window_valid(const view &v)
+{
+  auto win = window(v);
+  return win.x1 > win.x0 && win.y1 > win.y0;
+}
 
-        auto res = ray_trace(sc, origin, dir, sc.d, sc.bounces);
+size_t render_tile(scene &sc, framebuffer &fb, tile &t, const pixel_order &order,
+                   const render_options &opts)
+{
+  size_t taken = 0;
+  if (opts.wavefront)
+  {
+    while (auto n = trace_wavefront(sc, fb, t, order, max_samples(sc), opts))
+      taken += n;
+  }
+  else if (opts.packets)
+  {
+    // runs of neighbouring pixels take a sample each at a time, so their
+    // camera rays make a packet; every pixel still takes its samples in order
+    std::vector<std::pair<int, int>> run;
+    auto sample_run = [&]()
+    {
+      while (auto n = sample_packet(sc, fb, run, max_samples(sc)))
+        taken += n;
+      run.clear();
+    };
+    for_each_pixel(t, order, [&](int i, int j)
+                   {
+                     run.push_back({i, j});
+                     if (run.size() == ray_packet::size)
+                       sample_run();
+                   });
+    sample_run();
+  }
+  else
+  {
+    for_each_pixel(t, order, [&](int i, int j)
+                   {
+                     auto p = fb.index(i, j);
+                     while (needs_sample(sc, max_samples(sc), fb.samples[p], luminance(fb.sum[p]), fb.sum2[p]))
+                     {
+                       vec c;
+                       bool hit = sample_pixel(sc, i, j, fb.samples[p], c);
+                       fb.add(i, j, c, hit);
+                       ++taken;
+                     }
+                   });
+  }
+  release_occluders();
+  return taken;
+}
 
-        if (res.obj_hit)
-        {
-          hit_any = true;
-          c = c + (1.0f / sc.aa) * res.intensity;
-        }
-      }
+// one more sample, below limit, for every pixel of t that needs one
+static size_t sample_tile(scene &sc, framebuffer &fb, tile &t, const pixel_order &order,
+                          int limit, const render_options &opts)
+{
+  size_t taken = 0;
+  if (opts.wavefront)
+  {
+    taken = trace_wavefront(sc, fb, t, order, limit, opts);
+  }
+  else if (opts.packets)
+  {
+    std::vector<std::pair<int, int>> run;
+    for_each_pixel(t, order, [&](int i, int j)
+                   {
+                     run.push_back({i, j});
+                     if (run.size() < ray_packet::size)
+                       return;
+                     taken += sample_packet(sc, fb, run, limit);
+                     run.clear();
+                   });
+    taken += sample_packet(sc, fb, run, limit);
+  }
+  else
+  {
+    for_each_pixel(t, order, [&](int i, int j)
+                   {
+                     auto p = fb.index(i, j);
+                     if (!needs_sample(sc, limit, fb.samples[p], luminance(fb.sum[p]), fb.sum2[p]))
+                       return;
+                     vec c;
+                     bool hit = sample_pixel(sc, i, j, fb.samples[p], c);
+                     fb.add(i, j, c, hit);
+                     ++taken;
+                   });
+  }
+  release_occluders();
+  return taken;
+}
 
-      if (hit_any)
-      {
-        image[4 * (i * sc.width + j)] = gamma(c.x, sc.expose) * 255;
-        image[4 * (i * sc.width + j) + 1] = gamma(c.y, sc.expose) * 255;
-        image[4 * (i * sc.width + j) + 2] = gamma(c.z, sc.expose) * 255;
-        image[4 * (i * sc.width + j) + 3] = 255;
-      }
+// the output frame of a render: the window, or all of the image for cropfull
+static tile output_frame(scene &sc)
+{
+  if (sc.crop && sc.crop_full)
+    return {0, 0, sc.width, sc.height};
+  return window(sc);
+}
+
+bool write_image(scene &sc, std::vector<unsigned char> &image, const std::string &filename)
+{
+  auto win = window(sc), frame = output_frame(sc);
+  int w = win.x1 - win.x0;
+  png_writer out(filename, frame.x1 - frame.x0, frame.y1 - frame.y0);
+  std::vector<unsigned char> padded(4 * (frame.x1 - frame.x0));
+
+  for (int i = frame.y0; i < frame.y1; ++i)
+  {
+    if (frame.x0 == win.x0 && frame.x1 == win.x1)
+    {
+      if (!out.write_row(&image[4 * (i - win.y0) * w]))
+        return false;
+      continue;
     }
+    std::fill(padded.begin(), padded.end(), 0);
+    if (i >= win.y0 && i < win.y1)
+      std::copy_n(&image[4 * (i - win.y0) * w], 4 * w, &padded[4 * (win.x0 - frame.x0)]);
+    if (!out.write_row(padded.data()))
+      return false;
+  }
+  return out.finish();
+}
 
-    std::cout << "progress: " << (i + 1.0) / h << '\r' << std::flush;
+/**
+ * The NUMA layout to render sc with, or null without opts.numa. One is kept
+ * for the process, so the scene is replicated once rather than for every
+ * frame, camera and server request, and only rebuilt for another scene or
+ * other settings.
+ */
+static numa_layout *numa_for(scene &sc, const render_options &opts)
+{
+  static std::unique_ptr<numa_layout> layout;
+  if (!opts.numa)
+    return nullptr;
+  if (!layout || !layout->fits(sc, opts.threads, opts.numa_replicate))
+  {
+    layout.reset();
+    layout.reset(new numa_layout(sc, opts.threads, opts.numa_replicate, opts.scene_cpu));
+  }
+  layout->start();
+  return layout.get();
+}
+
+/**
+ * Takes one sample per pixel per pass, so the whole image sharpens evenly and
+ * every snapshot is a usable preview. With adaptive sampling, pixels drop out
+ * of later passes once they have converged.
+ *
+ * With a time budget the sample count is uncapped and passes continue until
+ * the budget runs out. Tiles that haven't started by then are skipped, except
+ * in the first pass, so every pixel gets at least one sample.
+ */
+bool render_progressive(scene &sc, framebuffer &fb, const render_options &opts,
+                        const std::function<void(const tile &)> &tile_done)
+{
+  using clock = std::chrono::steady_clock;
+  auto win = window(sc);
+  auto tiles = make_tiles(win, opts.tile_size, opts.tile_curve);
+  pixel_order order(opts.tile_size, opts.pixel_curve);
+  auto start = clock::now(), last_snapshot = start, last_checkpoint = start;
+  auto deadline = start + std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<float>(opts.time_budget));
+  bool budgeted = opts.time_budget > 0;
+  int passes = budgeted ? std::numeric_limits<int>::max() : max_samples(sc);
+  auto numa = numa_for(sc, opts);
+
+  int k = 0;
+  if (!opts.resume.empty() && !fb.load(opts.resume, k))
+  {
+    std::cerr << "cannot resume from " << opts.resume << std::endl;
+    return false;
+  }
+
+  // progress counts pixel visits, sampled or not, so converged pixels count too
+  std::unique_ptr<progress_reporter> progress;
+  if (!opts.quiet)
+  {
+    size_t pixels = size_t(fb.width) * fb.height;
+    progress.reset(new progress_reporter(opts.threads, pixels, pixels * (passes - k),
+                                         opts.progress_interval, opts.progress_json,
+                                         opts.time_budget));
+  }
+
+  while (k < passes)
+  {
+    std::atomic<size_t> active(0);
+    if (progress)
+      progress->set_pass(k + 1, budgeted ? 0 : passes);
+
+    parallel_tiles(tiles, opts.threads, [&](tile &t, int worker)
+                   {
+                     auto tile_start = clock::now();
+                     if (budgeted && k && tile_start >= deadline)
+                       return;
+
+                     auto &s = numa ? numa->scene_for(worker) : sc;
+                     size_t sampled = sample_tile(s, fb, t, order, passes, opts);
+                     active += sampled;
+                     if (numa)
+                     {
+                       std::chrono::duration<double> took = clock::now() - tile_start;
+                       numa->record(worker, size_t(t.x1 - t.x0) * (t.y1 - t.y0), took.count());
+                     }
+                     if (progress)
+                       progress->add(worker, size_t(t.x1 - t.x0) * (t.y1 - t.y0), sampled, take_rays());
+                   },
+                   numa ? &numa->placement : nullptr);
+
+    auto now = clock::now();
+    if (++k == passes || !active || (budgeted && now >= deadline))
+      break;
+
+    std::chrono::duration<float> since_checkpoint = now - last_checkpoint;
+    if (!opts.checkpoint.empty() && since_checkpoint.count() >= opts.checkpoint_seconds)
+    {
+      if (!fb.save(opts.checkpoint, k))
+        std::cerr << "\ncannot write checkpoint " << opts.checkpoint << std::endl;
+      last_checkpoint = now;
+    }
+
+    std::chrono::duration<float> elapsed = now - last_snapshot;
+    if ((opts.snapshot_passes && k % opts.snapshot_passes == 0) ||
+        (opts.snapshot_seconds > 0 && elapsed.count() >= opts.snapshot_seconds))
+    {
+      std::vector<unsigned char> image(4 * fb.width * fb.height);
+      fb.tonemap(image, sc.expose);
+      if (!write_image(sc, image, sc.filename))
+        std::cerr << "\ncannot write snapshot " << sc.filename << std::endl;
+      last_snapshot = now;
+    }
+  }
+
+  progress.reset();
+  if (tile_done)
+  {
+    for (auto &t : tiles)
+      tile_done(t);
+  }
+
+  // the final state lets a budgeted render be extended later
+  if (!opts.checkpoint.empty() && !fb.save(opts.checkpoint, k))
+    std::cerr << "\ncannot write checkpoint " << opts.checkpoint << std::endl;
+
+  if (budgeted && !opts.quiet)
+  {
+    int lo, hi;
+    float avg;
+    fb.sample_counts(lo, avg, hi);
+    std::chrono::duration<float> elapsed = clock::now() - start;
+    if (opts.progress_json)
+      std::cout << "{\"sampled\":" << elapsed.count() << ",\"passes\":" << k
+                << ",\"samples_per_pixel\":" << avg << ",\"min_samples\":" << lo
+                << ",\"max_samples\":" << hi << "}" << std::endl;
+    else
+      std::cout << "sampled " << elapsed.count() << "s in " << k << " passes, "
+                << "samples per pixel: " << avg << " (min " << lo << ", max " << hi << ")"
+                << std::endl;
+  }
+  if (numa && !opts.quiet)
+    numa->report(std::cout, opts.progress_json);
+  if (!opts.quiet)
+    report_occluders(std::cout, opts.progress_json);
+  return true;
+}
+
+bool render(scene &sc, framebuffer &fb, const render_options &opts,
+            const std::function<void(const tile &)> &tile_done)
+{
+  reset_occluder_stats();
+  if (opts.workers)
+  {
+    return render_distributed(sc, fb, opts, tile_done);
+  }
+
+  if (opts.progressive || opts.time_budget > 0 ||
+      !opts.checkpoint.empty() || !opts.resume.empty())
+  {
+    return render_progressive(sc, fb, opts, tile_done);
+  }
+
+  auto win = window(sc);
+  auto tiles = make_tiles(win, opts.tile_size, opts.tile_curve);
+  pixel_order order(opts.tile_size, opts.pixel_curve);
+  auto numa = numa_for(sc, opts);
+  std::unique_ptr<progress_reporter> progress;
+  size_t pixels = size_t(win.x1 - win.x0) * (win.y1 - win.y0);
+  if (!opts.quiet)
+    progress.reset(new progress_reporter(opts.threads, pixels, pixels,
+                                         opts.progress_interval, opts.progress_json));
+
+  parallel_tiles(tiles, opts.threads, [&](tile &t, int worker)
+                 {
+                   auto tile_start = std::chrono::steady_clock::now();
+                   auto &s = numa ? numa->scene_for(worker) : sc;
+                   auto samples = render_tile(s, fb, t, order, opts);
+                   if (numa)
+                   {
+                     std::chrono::duration<double> took = std::chrono::steady_clock::now() - tile_start;
+                     numa->record(worker, size_t(t.x1 - t.x0) * (t.y1 - t.y0), took.count());
+                   }
+                   if (progress)
+                     progress->add(worker, size_t(t.x1 - t.x0) * (t.y1 - t.y0), samples, take_rays());
+                   if (tile_done)
+                     tile_done(t);
+                 },
+                 numa ? &numa->placement : nullptr);
+  progress.reset();
+  if (numa && !opts.quiet)
+    numa->report(std::cout, opts.progress_json);
+  if (!opts.quiet)
+    report_occluders(std::cout, opts.progress_json);
+  return true;
+}
+
+std::unique_ptr<png_pipeline> render_file_async(scene &sc, const render_options &opts)
+{
+  auto win = window(sc), frame = output_frame(sc);
+  framebuffer fb(win.x1 - win.x0, win.y1 - win.y0, win.x0, win.y0);
+  std::unique_ptr<png_pipeline> out(
+      new png_pipeline(sc.filename, win, frame.x0, frame.y0,
+                       frame.x1 - frame.x0, frame.y1 - frame.y0));
+  // tiles are tone-mapped as they finish, on the thread that finished them
+  if (!render(sc, fb, opts, [&](const tile &t)
+              {
+                fb.tonemap(out->image, sc.expose, t);
+                out->tile_done(t);
+              }))
+    return nullptr;
+
+  if (opts.pfm && !fb.save_pfm(pfm_filename(sc.filename), frame))
+  {
+    std::cerr << "cannot write " << pfm_filename(sc.filename) << std::endl;
+    return nullptr;
+  }
+  return out;
+}
+
+bool render_file(scene &sc, const render_options &opts)
+{
+  auto out = render_file_async(sc, opts);
+  return out && out->finish();
+}
+
+std::string pfm_filename(const std::string &filename)
+{
+  auto dot = filename.rfind('.');
+  if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+    return filename + ".pfm";
+  return filename.substr(0, dot) + ".pfm";
+}
+
+bool tonemap_file(const std::string &pfm, float exposure, const std::string &png)
+{
+  framebuffer fb(0, 0);
+  if (!fb.load_pfm(pfm))
+  {
+    std::cerr << "cannot read " << pfm << std::endl;
+    return false;
+  }
+  std::vector<unsigned char> image(4 * fb.width * fb.height);
+  fb.tonemap(image, exposure);
+  if (!write_png(png, image, fb.width, fb.height))
+  {
+    std::cerr << "cannot write " << png << std::endl;
+    return false;
   }
+  return true;
 }
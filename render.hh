@@ -1,6 +1,81 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
+#include "framebuffer.hh"
+#include "png.hh"
 #include "scene.hh"
+#include "tiles.hh"
 
-void render(scene &s, std::vector<unsigned char> &image);
\ No newline at end of file
+struct render_options
+{
+  int threads = 1;
+  int tile_size = 32;
+  // the order tiles are handed out in, and pixels walked within a tile
+  curve tile_curve = curve::row, pixel_curve = curve::row;
+  // one sample per pixel per pass, writing a PNG every few passes/seconds
+  bool progressive = false;
+  int snapshot_passes = 0;
+  float snapshot_seconds = 0;
+  // keep adding passes until this many seconds have passed (0: off)
+  float time_budget = 0;
+  // save the float accumulation state between passes, at most every
+  // checkpoint_seconds, and/or start from a saved state
+  std::string checkpoint, resume;
+  float checkpoint_seconds = 0;
+  // render tiles in this many forked worker processes instead of threads
+  int workers = 0;
+  // pin threads to NUMA nodes and report local/remote tile throughput, with a
+  // copy of the scene per node when numa_replicate is set
+  bool numa = false, numa_replicate = false;
+  // the CPU the scene was parsed on, and so whose node's memory it is in; -1
+  // when unknown
+  int scene_cpu = -1;
+  // no progress output
+  bool quiet = false;
+  // also write the linear radiance as a PFM next to every PNG
+  bool pfm = false;
+  // seconds between progress reports, printed as JSON lines with progress_json
+  float progress_interval = 1;
+  bool progress_json = false;
+  // trace a tile's samples a bounce at a time, see trace_wavefront, instead
+  // of one sample at a time, depth first
+  bool wavefront = false;
+  // wavefront: trace each wave's secondary rays grouped by where they start
+  // and which way they go
+  bool reorder_rays = true;
+  // intersect the camera rays of neighbouring pixels in packets
+  bool packets = true;
+};
+
+// the part of the image that gets rendered: the crop window, or all of it
+tile window(const view &v);
+// whether window(v) holds any pixels; a crop window that is inside out or
+// off the image doesn't
+bool window_valid(const view &v);
+// rays the calling thread has traced since the last call
+uint64_t take_rays();
+// takes all samples for the pixels of t, which must lie inside fb; returns
+// how many it took
+size_t render_tile(scene &sc, framebuffer &fb, tile &t, const pixel_order &order = pixel_order(),
+                   const render_options &opts = render_options());
+// renders window(s) into fb, which covers just that window, as linear
+// radiance; tile_done is called, from any thread, for each tile whose pixels
+// in fb are final
+bool render(scene &s, framebuffer &fb, const render_options &opts,
+            const std::function<void(const tile &)> &tile_done = nullptr);
+// encodes a rendered window, padding it out to the full frame for cropfull
+bool write_image(scene &sc, std::vector<unsigned char> &image, const std::string &filename);
+// renders the scene's current view into a PNG of sc.filename that is encoded
+// as the rows come in; what is left of the encode may still be running when
+// this returns, until the pipeline's finish. nullptr when rendering failed.
+std::unique_ptr<png_pipeline> render_file_async(scene &sc, const render_options &opts);
+// where the PFM for an image goes: its name with .pfm instead of .png
+std::string pfm_filename(const std::string &filename);
+// re-exposes a PFM written with a render into a PNG, without the scene
+bool tonemap_file(const std::string &pfm, float exposure, const std::string &png);
+// the same as render_file_async, waiting for the file to be written
+bool render_file(scene &sc, const render_options &opts);
@@ -0,0 +1,56 @@
+#include <cmath>
+#include "rng.hh"
+
+static void philox_round(uint32_t ctr[4], uint32_t key[2])
+{
+  uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+  uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+  uint32_t hi0 = p0 >> 32, lo0 = p0, hi1 = p1 >> 32, lo1 = p1;
+  uint32_t c0 = hi1 ^ ctr[1] ^ key[0], c2 = hi0 ^ ctr[3] ^ key[1];
+  ctr[0] = c0;
+  ctr[1] = lo1;
+  ctr[2] = c2;
+  ctr[3] = lo0;
+}
+
+rng::rng(uint32_t pixel, uint32_t sample)
+    : key{pixel, sample}, path(0), counter(0), used(4){};
+
+rng rng::split(uint32_t branch)
+{
+  rng child = *this;
+  // base-4 digits, one per bounce
+  child.path = path * 4 + 1 + branch % 3;
+  child.counter = 0;
+  child.used = 4;
+  return child;
+}
+
+void rng::refill()
+{
+  uint32_t k[2] = {key[0], key[1]};
+  block[0] = counter++;
+  block[1] = path;
+  block[2] = path >> 32;
+  block[3] = 0;
+  for (int i = 0; i < 10; ++i)
+  {
+    philox_round(block, k);
+    k[0] += 0x9E3779B9;
+    k[1] += 0xBB67AE85;
+  }
+  used = 0;
+}
+
+float rng::uniform()
+{
+  if (used == 4)
+    refill();
+  return (block[used++] >> 8) * (1.0f / 16777216.0f);
+}
+
+float rng::gaussian(float sigma)
+{
+  float u1 = uniform(), u2 = uniform();
+  return sigma * std::sqrt(-2 * std::log(1 - u1)) * std::cos(2 * float(M_PI) * u2);
+}
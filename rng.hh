@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Counter-based random numbers (Philox4x32-10). A stream is a pure function of
+ * its key (pixel, sample) and its path through the ray tree, so a sample draws
+ * the same numbers no matter which thread traces it or in what order, and no
+ * state is shared between threads.
+ */
+class rng
+{
+  uint32_t key[2];
+  uint64_t path;
+  uint32_t counter;
+  uint32_t block[4];
+  int used;
+
+public:
+  rng(uint32_t pixel, uint32_t sample);
+  // independent stream for a child ray; branch (0-2) tells siblings apart
+  rng split(uint32_t branch);
+  float uniform();
+  float gaussian(float sigma);
+
+private:
+  void refill();
+};
@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <bitset>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <cmath>
+#include <limits>
 #include "scene.hh"
 
 bool has_multiple_args(std::istream &s)
@@ -13,6 +16,148 @@ bool has_multiple_args(std::istream &s)
   return !std::isalpha(c);
 }
 
+bool parse_view(std::istream &s, const std::string &cmd, view &v)
+{
+  if (cmd == "png")
+  {
+    s >> v.width >> v.height >> v.filename;
+  }
+  else if (cmd == "output")
+  {
+    s >> v.filename;
+  }
+  else if (cmd == "eye")
+  {
+    s >> v.eye.x >> v.eye.y >> v.eye.z;
+  }
+  else if (cmd == "forward")
+  {
+    s >> v.forward.x >> v.forward.y >> v.forward.z;
+    v.right = v.forward.cross(v.up).normalize();
+    v.up = v.right.cross(v.forward).normalize();
+  }
+  else if (cmd == "up")
+  {
+    s >> v.up.x >> v.up.y >> v.up.z;
+    v.right = v.forward.cross(v.up).normalize();
+    v.up = v.right.cross(v.forward).normalize();
+  }
+  else if (cmd == "fisheye")
+  {
+    v.fisheye = true;
+  }
+  else if (cmd == "dof")
+  {
+    s >> v.focus >> v.lens;
+    v.dof = true;
+  }
+  else if (cmd == "expose")
+  {
+    s >> v.expose;
+  }
+  else if (cmd == "aa")
+  {
+    s >> v.aa;
+  }
+  else if (cmd == "adaptive")
+  {
+    s >> v.min_samples >> v.max_samples >> v.threshold;
+    // the variance estimate needs at least two samples
+    v.min_samples = std::max(2, v.min_samples);
+    v.max_samples = std::max(v.min_samples, v.max_samples);
+    v.adaptive = true;
+  }
+  else if (cmd == "crop" || cmd == "cropfull")
+  {
+    s >> v.crop_x0 >> v.crop_y0 >> v.crop_x1 >> v.crop_y1;
+    v.crop = true;
+    v.crop_full = cmd == "cropfull";
+  }
+  else if (cmd == "gi") // global illumination
+  {
+    s >> v.d;
+  }
+  else if (cmd == "bounces")
+  {
+    s >> v.bounces;
+  }
+  else if (cmd == "roulette")
+  {
+    s >> v.roulette;
+  }
+  else if (cmd == "lightsamples")
+  {
+    s >> v.light_samples;
+    v.light_samples = std::max(0, v.light_samples);
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// pads frame with zeros to width digits
+static std::string frame_number(int frame, int width)
+{
+  auto number = std::to_string(frame);
+  if (int(number.size()) < width)
+    number.insert(0, width - number.size(), '0');
+  return number;
+}
+
+// pattern with its %d or %0Nd replaced by frame, or without one, with the
+// frame number inserted before the extension as .NNNN
+static std::string frame_filename(const std::string &pattern, int frame)
+{
+  for (auto pos = pattern.find('%'); pos != std::string::npos; pos = pattern.find('%', pos + 1))
+  {
+    auto end = pattern.find_first_not_of("0123456789", pos + 1);
+    if (end == std::string::npos || pattern[end] != 'd')
+      continue;
+    auto width = pattern.substr(pos + 1, end - pos - 1);
+    return pattern.substr(0, pos) + frame_number(frame, width.empty() ? 0 : std::stoi(width)) +
+           pattern.substr(end + 1);
+  }
+
+  auto dot = pattern.rfind('.'), slash = pattern.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = pattern.size();
+  return pattern.substr(0, dot) + "." + frame_number(frame, 4) + pattern.substr(dot);
+}
+
+template <typename T>
+static T catmull_rom(T p0, T p1, T p2, T p3, float t)
+{
+  return 0.5f * (2.0f * p1 + t * (p2 - p0) +
+                 t * t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) +
+                 t * t * t * (3.0f * p1 - p0 - 3.0f * p2 + p3));
+}
+
+view animate(view v, std::vector<keyframe> &keys, int frame)
+{
+  v.filename = frame_filename(v.filename, frame);
+  if (keys.empty())
+    return v;
+
+  int n = keys.size(), k = 0;
+  while (k + 1 < n && keys[k + 1].frame <= frame)
+    ++k;
+  auto &k0 = keys[std::max(k - 1, 0)], &k1 = keys[k];
+  auto &k2 = keys[std::min(k + 1, n - 1)], &k3 = keys[std::min(k + 2, n - 1)];
+  float t = k2.frame == k1.frame ? 0 : float(frame - k1.frame) / (k2.frame - k1.frame);
+  t = std::clamp(t, 0.0f, 1.0f);
+
+  v.eye = catmull_rom(k0.eye, k1.eye, k2.eye, k3.eye, t);
+  // not normalized: the length of forward sets the field of view
+  v.forward = catmull_rom(k0.forward, k1.forward, k2.forward, k3.forward, t);
+  v.focus = catmull_rom(k0.focus, k1.focus, k2.focus, k3.focus, t);
+  auto up = catmull_rom(k0.up, k1.up, k2.up, k3.up, t);
+  v.right = v.forward.cross(up).normalize();
+  v.up = v.right.cross(v.forward).normalize();
+  return v;
+}
+
 scene parse(char *filename)
 {
   scene sc;
@@ -32,9 +177,35 @@ scene parse(char *filename)
 
   while (fs >> cmd)
   {
-    if (cmd == "png")
+    if (parse_view(fs, cmd, sc))
     {
-      fs >> sc.width >> sc.height >> sc.filename;
+      continue;
+    }
+    if (cmd == "keyframe")
+    {
+      keyframe key;
+      fs >> key.frame;
+      key.eye = sc.eye;
+      key.forward = sc.forward;
+      key.up = sc.up;
+      key.focus = sc.focus;
+      auto pos = std::find_if(sc.keyframes.begin(), sc.keyframes.end(),
+                              [&](keyframe &k)
+                              { return k.frame >= key.frame; });
+      if (pos != sc.keyframes.end() && pos->frame == key.frame)
+        *pos = key;
+      else
+        sc.keyframes.insert(pos, key);
+    }
+    else if (cmd == "frames")
+    {
+      fs >> sc.first_frame >> sc.last_frame;
+    }
+    else if (cmd == "camera")
+    {
+      std::string name;
+      fs >> name >> sc.filename;
+      sc.cameras.emplace_back(name, sc);
     }
     else if (cmd == "sun")
     {
@@ -110,43 +281,8 @@ scene parse(char *filename)
       std::string filename;
       fs >> filename;
       cur_texture = filename == "none" ? nullptr : new texture(filename);
-    }
-    else if (cmd == "eye")
-    {
-      fs >> sc.eye.x >> sc.eye.y >> sc.eye.z;
-    }
-    else if (cmd == "forward")
-    {
-      fs >> sc.forward.x >> sc.forward.y >> sc.forward.z;
-      sc.right = sc.forward.cross(sc.up).normalize();
-      sc.up = sc.right.cross(sc.forward).normalize();
-    }
-    else if (cmd == "up")
-    {
-      fs >> sc.up.x >> sc.up.y >> sc.up.z;
-      sc.right = sc.forward.cross(sc.up).normalize();
-      sc.up = sc.right.cross(sc.forward).normalize();
-    }
-    else if (cmd == "fisheye")
-    {
-      sc.fisheye = true;
-    }
-    else if (cmd == "dof")
-    {
-      fs >> sc.focus >> sc.lens;
-      sc.dof = true;
-    }
-    else if (cmd == "expose")
-    {
-      fs >> sc.expose;
-    }
-    else if (cmd == "aa")
-    {
-      fs >> sc.aa;
-    }
-    else if (cmd == "gi") // global illumination
-    {
-      fs >> sc.d;
+      if (cur_texture)
+        sc.textures.emplace_back(cur_texture);
     }
     else if (cmd == "shininess")
     {
@@ -172,16 +308,19 @@ scene parse(char *filename)
     {
       fs >> cur_ior;
     }
-    else if (cmd == "bounces")
-    {
-      fs >> sc.bounces;
-    }
     else if (cmd == "roughness")
     {
       fs >> cur_roughness;
     }
   }
 
+  if (!sc.keyframes.empty() && sc.last_frame < sc.first_frame)
+  {
+    sc.first_frame = sc.keyframes.front().frame;
+    sc.last_frame = sc.keyframes.back().frame;
+  }
+  sc.sampled_lights.build(sc.lights);
+
   return sc;
 }
 
@@ -229,6 +368,23 @@ float sphere::intersect(vec o, vec dir)
   return inside ? t_center + t_offset : t_center - t_offset;
 }
 
+static texture *copy_texture(texture *t, texture_map &textures)
+{
+  if (!t)
+    return nullptr;
+  auto &copy = textures[t];
+  if (!copy)
+    copy = new texture(*t);
+  return copy;
+}
+
+object *sphere::clone(texture_map &textures)
+{
+  auto copy = new sphere(*this);
+  copy->_texture = copy_texture(_texture, textures);
+  return copy;
+}
+
 vec sphere::norm_at(vec p)
 {
   return (p - c).normalize();
@@ -238,8 +394,8 @@ vec sphere::color_at(vec p)
 {
   if (_texture)
   {
-    float s = (std::atan2f(c.z - p.z, p.x - c.x) + M_PI) / (2 * M_PI);
-    float t = std::abs(std::atan2f(p.z - c.z, p.y - c.y)) / M_PI;
+    float s = (std::atan2(c.z - p.z, p.x - c.x) + M_PI) / (2 * M_PI);
+    float t = std::abs(std::atan2(p.z - c.z, p.y - c.y)) / M_PI;
     if (s > 1)
       s -= 1;
     return _texture->color_at(vec(s, t, 0));
@@ -279,6 +435,11 @@ float plane::intersect(vec o, vec dir)
   return std::max(t, 0.0f);
 }
 
+object *plane::clone(texture_map &)
+{
+  return new plane(*this);
+}
+
 vec plane::norm_at(vec)
 {
   return vec(a, b, c).normalize();
@@ -321,6 +482,13 @@ float triangle::intersect(vec o, vec dir)
   return t;
 }
 
+object *triangle::clone(texture_map &textures)
+{
+  auto copy = new triangle(*this);
+  copy->_texture = copy_texture(_texture, textures);
+  return copy;
+}
+
 vec triangle::norm_at(vec p)
 {
   auto b1 = (p - p0).dot(e1), b2 = (p - p0).dot(e2), b0 = 1 - b1 - b2;
@@ -356,6 +524,11 @@ float directional_light::dist(vec)
   return std::numeric_limits<float>::max();
 }
 
+light *directional_light::clone()
+{
+  return new directional_light(*this);
+}
+
 point_light::~point_light(){};
 
 vec point_light::dir(vec o)
@@ -374,6 +547,124 @@ float point_light::dist(vec o)
   return (_pos - o).norm();
 }
 
+light *point_light::clone()
+{
+  return new point_light(*this);
+}
+
+void light_tree::build(std::vector<std::unique_ptr<light>> &lights)
+{
+  nodes.clear();
+  others.clear();
+  std::vector<std::pair<int, point_light *>> points;
+  for (size_t i = 0; i < lights.size(); ++i)
+  {
+    if (auto *p = dynamic_cast<point_light *>(lights[i].get()))
+      points.push_back({i, p});
+    else
+      others.push_back(i);
+  }
+  if (!points.empty())
+    build(points, 0, points.size());
+}
+
+// builds the subtree over lights [begin, end), split at the median of the
+// longest axis; returns its root
+int light_tree::build(std::vector<std::pair<int, point_light *>> &lights, int begin, int end)
+{
+  int index = nodes.size();
+  nodes.emplace_back();
+  node nd;
+  nd.lo = nd.hi = lights[begin].second->position();
+  nd.power = 0;
+  for (int i = begin; i < end; ++i)
+  {
+    auto p = lights[i].second->position();
+    auto c = lights[i].second->color();
+    nd.lo = vec(std::min(nd.lo.x, p.x), std::min(nd.lo.y, p.y), std::min(nd.lo.z, p.z));
+    nd.hi = vec(std::max(nd.hi.x, p.x), std::max(nd.hi.y, p.y), std::max(nd.hi.z, p.z));
+    nd.power += std::max({c.x, c.y, c.z, 0.0f});
+  }
+
+  if (end - begin == 1)
+  {
+    nd.light = lights[begin].first;
+  }
+  else
+  {
+    auto extent = nd.hi - nd.lo;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    auto coord = [axis](point_light *l)
+    {
+      auto p = l->position();
+      return axis == 0 ? p.x : axis == 1 ? p.y : p.z;
+    };
+    int mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                     [&](const std::pair<int, point_light *> &a, const std::pair<int, point_light *> &b)
+                     { return coord(a.second) < coord(b.second); });
+    nd.left = build(lights, begin, mid);
+    nd.right = build(lights, mid, end);
+  }
+  nodes[index] = nd;
+  return index;
+}
+
+/**
+ * Roughly how much the lights under nd can light p: their power over the
+ * squared distance, as point lights fall off, but never closer than the
+ * node's bounding sphere. Zero only when the whole box is behind the surface,
+ * where no light in it adds anything.
+ */
+float light_tree::importance(const node &nd, vec p, vec n) const
+{
+  vec lo = nd.lo, hi = nd.hi;
+  float front = -std::numeric_limits<float>::max();
+  for (int k = 0; k < 8; ++k)
+  {
+    vec corner(k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z);
+    front = std::max(front, (corner - p).dot(n));
+  }
+  if (front <= 0)
+    return 0;
+
+  auto center = 0.5 * (lo + hi);
+  float d2 = (center - p).squared_norm(), r2 = 0.25f * (hi - lo).squared_norm();
+  return nd.power * std::min(100.0f, 1 / std::max({d2, r2, 1e-6f}));
+}
+
+bool light_tree::sample(vec p, vec n, float u, int &index, float &pdf) const
+{
+  if (nodes.empty() || importance(nodes[0], p, n) <= 0)
+    return false;
+  pdf = 1;
+  int k = 0;
+  while (nodes[k].light < 0)
+  {
+    auto &nd = nodes[k];
+    float l = importance(nodes[nd.left], p, n), r = importance(nodes[nd.right], p, n);
+    if (l + r <= 0)
+      return false;
+    float q = l / (l + r);
+    // u is reused, rescaled to [0, 1) within the branch taken
+    if (u < q)
+    {
+      u = u / q;
+      pdf *= q;
+      k = nd.left;
+    }
+    else
+    {
+      u = (u - q) / (1 - q);
+      pdf *= 1 - q;
+      k = nd.right;
+    }
+    u = std::min(u, 0.99999994f);
+  }
+  index = nodes[k].light;
+  return true;
+}
+
 void bvh_node::split()
 {
   auto [x1, x2, y1, y2, z1, z2] = box;
@@ -464,3 +755,237 @@ std::pair<object *const, float> bvh_node::intersect(vec o, vec dir)
 
   return {obj_hit, t_hit};
 }
+
+object *bvh_node::occluded(vec o, vec dir, float t_max)
+{
+  if (is_leaf)
+  {
+    for (auto &obj : objects)
+    {
+      // offset as in intersect
+      auto t = obj->intersect(o + 1e-3 * dir, dir);
+      if (t > 0 && t < t_max)
+        return obj.get();
+    }
+    return nullptr;
+  }
+  for (auto &child : children)
+  {
+    if (!child->box.intersect(o, dir))
+      continue;
+    if (auto *obj = child->occluded(o, dir, t_max))
+      return obj;
+  }
+  return nullptr;
+}
+
+void ray_packet::add(vec o, vec dir)
+{
+  ox[count] = o.x, oy[count] = o.y, oz[count] = o.z;
+  dx[count] = dir.x, dy[count] = dir.y, dz[count] = dir.z;
+  ++count;
+}
+
+// below this many rays going into a node, they go on one at a time
+static const int min_coherent = 3;
+
+/**
+ * Bounds on where a packet's rays start and which way they go, for telling
+ * that a box misses all of them with a single slab test. It only applies
+ * when every ray goes the same way along each axis: then every ray's slab
+ * distances lie between those computed from the extreme origins and
+ * directions, since rounding never reverses the order of two results.
+ */
+struct bvh_node::packet_frustum
+{
+  bool usable = true;
+  // per axis: whether directions are negative, origin bounds and bounds on
+  // the size of the direction
+  bool negative[3];
+  float o_lo[3], o_hi[3], d_lo[3], d_hi[3];
+
+  packet_frustum(const ray_packet &rays)
+  {
+    const float *o[3] = {rays.ox, rays.oy, rays.oz}, *d[3] = {rays.dx, rays.dy, rays.dz};
+    for (int a = 0; a < 3; ++a)
+    {
+      negative[a] = d[a][0] < 0;
+      o_lo[a] = o_hi[a] = o[a][0];
+      d_lo[a] = d_hi[a] = std::abs(d[a][0]);
+      for (int k = 0; k < rays.count; ++k)
+      {
+        if (d[a][k] == 0 || (d[a][k] < 0) != negative[a])
+          usable = false;
+        o_lo[a] = std::min(o_lo[a], o[a][k]);
+        o_hi[a] = std::max(o_hi[a], o[a][k]);
+        d_lo[a] = std::min(d_lo[a], std::abs(d[a][k]));
+        d_hi[a] = std::max(d_hi[a], std::abs(d[a][k]));
+      }
+    }
+  }
+
+  // true only when aabb::intersect is false for every ray
+  bool misses(const aabb &box) const
+  {
+    if (!usable)
+      return false;
+    float lo[3] = {box.x1, box.y1, box.z1}, hi[3] = {box.x2, box.y2, box.z2};
+    float t1 = 0, t2 = std::numeric_limits<float>::max();
+    for (int a = 0; a < 3; ++a)
+    {
+      // distances to the near and far slab, measured along a positive
+      // direction; (x - o) / -d is exactly (o - x) / d
+      float near = negative[a] ? o_lo[a] - hi[a] : lo[a] - o_hi[a];
+      float far = negative[a] ? o_hi[a] - lo[a] : hi[a] - o_lo[a];
+      t1 = std::max(t1, near / (near >= 0 ? d_hi[a] : d_lo[a]));
+      t2 = std::min(t2, far / (far >= 0 ? d_lo[a] : d_hi[a]));
+    }
+    return t1 >= t2;
+  }
+};
+
+// aabb::intersect for every ray of the packet, as a bit mask
+static unsigned box_hits(const aabb &box, const ray_packet &rays)
+{
+  bool hit[ray_packet::size];
+  for (int k = 0; k < ray_packet::size; ++k)
+  {
+    auto tx1 = (box.x1 - rays.ox[k]) / rays.dx[k];
+    auto tx2 = (box.x2 - rays.ox[k]) / rays.dx[k];
+    auto ty1 = (box.y1 - rays.oy[k]) / rays.dy[k];
+    auto ty2 = (box.y2 - rays.oy[k]) / rays.dy[k];
+    auto tz1 = (box.z1 - rays.oz[k]) / rays.dz[k];
+    auto tz2 = (box.z2 - rays.oz[k]) / rays.dz[k];
+    // the same comparisons, in the same order, as the initializer lists
+    // there, which the vectorizer won't take
+    auto t1 = std::max(std::max(std::max(0.0f, std::min(tx1, tx2)), std::min(ty1, ty2)),
+                       std::min(tz1, tz2));
+    auto t2 = std::min(std::min(std::min(std::numeric_limits<float>::max(), std::max(tx1, tx2)),
+                                std::max(ty1, ty2)),
+                       std::max(tz1, tz2));
+    hit[k] = t1 < t2;
+  }
+  unsigned mask = 0;
+  for (int k = 0; k < ray_packet::size; ++k)
+    mask |= unsigned(hit[k]) << k;
+  return mask;
+}
+
+void bvh_node::intersect(const ray_packet &rays, object **obj_hit, float *t_hit)
+{
+  packet_frustum frustum(rays);
+  object *obj[ray_packet::size];
+  float t[ray_packet::size];
+  intersect(rays, frustum, (1u << rays.count) - 1, obj, t);
+  std::copy_n(obj, rays.count, obj_hit);
+  std::copy_n(t, rays.count, t_hit);
+}
+
+// the same walk as the single ray intersect, for the rays in active
+void bvh_node::intersect(const ray_packet &rays, const packet_frustum &frustum, unsigned active,
+                         object **obj_hit, float *t_hit)
+{
+  std::fill_n(obj_hit, ray_packet::size, nullptr);
+  std::fill_n(t_hit, ray_packet::size, std::numeric_limits<float>::max());
+
+  if (is_leaf)
+  {
+    for (auto &obj : objects)
+    {
+      for (int k = 0; k < rays.count; ++k)
+      {
+        if (!(active >> k & 1))
+          continue;
+        auto o = rays.origin(k), dir = rays.dir(k);
+        auto t = obj->intersect(o + 1e-3 * dir, dir);
+        if (t > 0 && t < t_hit[k])
+        {
+          obj_hit[k] = obj.get();
+          t_hit[k] = t;
+        }
+      }
+    }
+    return;
+  }
+
+  object *child_obj[ray_packet::size];
+  float child_t[ray_packet::size];
+  for (auto &child : children)
+  {
+    if (frustum.misses(child->box))
+      continue;
+    unsigned hits = box_hits(child->box, rays) & active;
+    if (!hits)
+      continue;
+
+    if (std::bitset<ray_packet::size>(hits).count() < min_coherent)
+    {
+      for (int k = 0; k < rays.count; ++k)
+      {
+        if (!(hits >> k & 1))
+          continue;
+        auto [obj, t] = child->intersect(rays.origin(k), rays.dir(k));
+        if (obj && t < t_hit[k])
+        {
+          obj_hit[k] = obj;
+          t_hit[k] = t;
+        }
+      }
+      continue;
+    }
+
+    child->intersect(rays, frustum, hits, child_obj, child_t);
+    for (int k = 0; k < rays.count; ++k)
+    {
+      if ((hits >> k & 1) && child_obj[k] && child_t[k] < t_hit[k])
+      {
+        obj_hit[k] = child_obj[k];
+        t_hit[k] = child_t[k];
+      }
+    }
+  }
+}
+
+void bvh_node::replicate(bvh_node &other, object_map &copies, texture_map &textures)
+{
+  is_leaf = other.is_leaf;
+  box = other.box;
+  objects.clear();
+  children.clear();
+  for (auto &obj : other.objects)
+  {
+    auto &copy = copies[obj.get()];
+    if (!copy)
+      copy.reset(obj->clone(textures));
+    objects.push_back(copy);
+  }
+  for (auto &child : other.children)
+  {
+    children.emplace_back(new bvh_node());
+    children.back()->replicate(*child, copies, textures);
+  }
+}
+
+std::unique_ptr<scene> replicate(scene &sc)
+{
+  std::unique_ptr<scene> copy(new scene());
+  static_cast<view &>(*copy) = sc;
+  copy->cameras = sc.cameras;
+  copy->keyframes = sc.keyframes;
+  copy->first_frame = sc.first_frame;
+  copy->last_frame = sc.last_frame;
+  for (auto &l : sc.lights)
+  {
+    copy->lights.emplace_back(l->clone());
+  }
+  copy->sampled_lights = sc.sampled_lights;
+
+  object_map objects;
+  texture_map textures;
+  copy->objects.replicate(sc.objects, objects, textures);
+  for (auto &[original, t] : textures)
+  {
+    copy->textures.emplace_back(t);
+  }
+  return copy;
+}
@@ -2,7 +2,9 @@
 
 #include <vector>
 #include <array>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include "vec.hh"
 #include "lodepng.hh"
@@ -20,6 +22,12 @@ public:
 
 std::ostream &operator<<(std::ostream &s, aabb &b);
 
+class object;
+
+// originals to copies, while a scene is being replicated
+using texture_map = std::unordered_map<texture *, texture *>;
+using object_map = std::unordered_map<object *, std::shared_ptr<object>>;
+
 class object
 
 {
@@ -33,6 +41,7 @@ public:
   virtual bool might_intersect(aabb &box) = 0;
   virtual vec norm_at(vec p) = 0;
   virtual vec color_at(vec p) = 0;
+  virtual object *clone(texture_map &textures) = 0;
 };
 
 class sphere : public object
@@ -51,6 +60,7 @@ public:
   bool might_intersect(aabb &box);
   vec norm_at(vec p);
   vec color_at(vec p);
+  object *clone(texture_map &textures);
 };
 
 class plane : public object
@@ -67,6 +77,7 @@ public:
   bool might_intersect(aabb &box);
   vec norm_at(vec p);
   vec color_at(vec p);
+  object *clone(texture_map &textures);
 };
 
 class triangle : public object
@@ -97,6 +108,7 @@ public:
   bool might_intersect(aabb &box);
   vec norm_at(vec p);
   vec color_at(vec p);
+  object *clone(texture_map &textures);
 };
 
 class light
@@ -106,6 +118,7 @@ public:
   virtual vec dir(vec) = 0;
   virtual vec intensity(vec) = 0;
   virtual float dist(vec) = 0;
+  virtual light *clone() = 0;
 };
 
 class directional_light : public light
@@ -119,6 +132,7 @@ public:
   vec dir(vec o);
   vec intensity(vec o);
   float dist(vec o);
+  light *clone();
 };
 
 class point_light : public light
@@ -129,13 +143,35 @@ class point_light : public light
 public:
   ~point_light();
   point_light(vec pos, vec color) : _pos(pos), _color(color){};
+  vec position() { return _pos; }
+  vec color() { return _color; }
   vec dir(vec o);
   vec intensity(vec o);
   float dist(vec o);
+  light *clone();
+};
+
+/**
+ * Up to size rays that go through the BVH together, such as neighbouring
+ * camera rays, kept as arrays per coordinate so that a box is tested against
+ * all of them in one loop the compiler can vectorize.
+ */
+struct ray_packet
+{
+  static const int size = 8;
+  int count = 0;
+  float ox[size] = {}, oy[size] = {}, oz[size] = {};
+  float dx[size] = {}, dy[size] = {}, dz[size] = {};
+
+  void add(vec o, vec dir);
+  vec origin(int k) const { return vec(ox[k], oy[k], oz[k]); }
+  vec dir(int k) const { return vec(dx[k], dy[k], dz[k]); }
 };
 
 class bvh_node
 {
+  struct packet_frustum;
+
   bool is_leaf = true;
   aabb box;
   std::vector<std::shared_ptr<object>> objects;
@@ -147,24 +183,128 @@ public:
       : box(x1, x2, y1, y2, z1, z2){};
 
   std::pair<object *const, float> intersect(vec o, vec dir);
+  // intersect for each ray of the packet, into obj_hit[k] and t_hit[k], with
+  // identical results; the rays walk the tree together, while enough of them
+  // go the same way, and finish alone once they scatter
+  void intersect(const ray_packet &rays, object **obj_hit, float *t_hit);
+  // the first object found on the ray closer than t_max, or nullptr; it
+  // stops there rather than looking for the closest
+  object *occluded(vec o, vec dir, float t_max);
+  const aabb &bounds() const { return box; }
   void add(std::shared_ptr<object> obj);
+  // makes this node a deep copy of other, sharing each object copy between
+  // all the leaves that hold the original
+  void replicate(bvh_node &other, object_map &objects, texture_map &textures);
 
 private:
   void split();
+  void intersect(const ray_packet &rays, const packet_frustum &frustum, unsigned active,
+                 object **obj_hit, float *t_hit);
+};
+
+/**
+ * A bounding volume hierarchy over a scene's point lights, for picking a few
+ * of many in proportion to how much each might light a given point: every
+ * node bounds its lights' positions and sums their power. Directional lights
+ * light every point alike, so they stay out of it and are always lit.
+ */
+class light_tree
+{
+  struct node
+  {
+    vec lo, hi;
+    float power;
+    // the children, or for a leaf the light's index in the scene's lights
+    int left = -1, right = -1, light = -1;
+  };
+  std::vector<node> nodes;
+  std::vector<int> others;
+
+  int build(std::vector<std::pair<int, point_light *>> &lights, int begin, int end);
+  float importance(const node &nd, vec p, vec n) const;
+
+public:
+  void build(std::vector<std::unique_ptr<light>> &lights);
+  bool empty() const { return nodes.empty(); }
+  // indices of the lights left out of the tree
+  const std::vector<int> &unsampled() const { return others; }
+  // picks a light for the point p with normal n, using u in [0, 1): its
+  // index in the scene's lights and the probability it had of being picked.
+  // Every light that can reach p has some chance; false when none can.
+  bool sample(vec p, vec n, float u, int &index, float &pdf) const;
 };
 
-class scene
+/**
+ * Everything that describes one rendered image of a scene: camera, output and
+ * sampling settings. It can be copied and overridden without touching the
+ * geometry, lights and BVH the scene holds.
+ */
+class view
 {
 public:
   int width, height, aa, d, bounces;
   float expose, focus, lens;
   vec eye, forward, right, up;
   bool fisheye, dof;
-  scene()
-      : aa(1), bounces(4), eye(0, 0, 0), forward(0, 0, -1), right(1, 0, 0), up(0, 1, 0){};
+  // adaptive sampling: between min_samples and max_samples per pixel, until
+  // the standard error of the pixel's mean luminance drops below threshold
+  bool adaptive;
+  int min_samples, max_samples;
+  float threshold;
+  // render only the pixels in [crop_x0, crop_x1) x [crop_y0, crop_y1);
+  // crop_full writes a full-size image with the rest left transparent
+  bool crop, crop_full;
+  int crop_x0, crop_y0, crop_x1, crop_y1;
+  // rays whose share of the pixel is below this play Russian roulette ("roulette W")
+  float roulette;
+  // point lights sampled per shading point from the light tree, 0 for all of
+  // them ("lightsamples N")
+  int light_samples;
+  view()
+      : width(0), height(0), aa(1), d(0), bounces(4), expose(0), focus(0), lens(0),
+        eye(0, 0, 0), forward(0, 0, -1), right(1, 0, 0), up(0, 1, 0),
+        fisheye(false), dof(false), adaptive(false), crop(false), crop_full(false),
+        roulette(0), light_samples(0){};
   std::string filename;
+};
+
+// camera pose at one frame of an animation, from "keyframe FRAME"
+struct keyframe
+{
+  int frame;
+  vec eye, forward, up;
+  float focus;
+};
+
+class scene : public view
+{
+public:
+  // keyframes in frame order, and the frames to render ("frames FIRST LAST";
+  // by default the span of the keyframes)
+  std::vector<keyframe> keyframes;
+  int first_frame = 0, last_frame = -1;
+  // views declared with "camera NAME FILE", each a copy of the view as it
+  // stood at that point of the scene file, rendering to FILE
+  std::vector<std::pair<std::string, view>> cameras;
   std::vector<std::unique_ptr<light>> lights;
+  light_tree sampled_lights;
   bvh_node objects;
+  std::vector<std::unique_ptr<texture>> textures;
 };
 
+/**
+ * A deep copy of the scene, allocated by the calling thread. Built on a thread
+ * pinned to a NUMA node, first-touch allocation puts the copy in that node's
+ * memory.
+ */
+std::unique_ptr<scene> replicate(scene &sc);
+
+// applies cmd if it is a view command, reading its arguments from s
+bool parse_view(std::istream &s, const std::string &cmd, view &v);
+/**
+ * v with its camera moved to the given frame, interpolating the keyframes
+ * with a Catmull-Rom spline, and the frame number put into its filename in
+ * place of a %d/%0Nd pattern (or before the extension if there is none).
+ */
+view animate(view v, std::vector<keyframe> &keys, int frame);
 scene parse(char *filename);
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "distributed.hh"
+#include "server.hh"
+
+// renders one request; returns the reply line, or an empty string for "quit"
+static std::string handle(scene &sc, const render_options &opts, const std::string &line)
+{
+  std::istringstream s(line);
+  std::string cmd, error;
+  view saved = sc;
+
+  while (s >> cmd)
+  {
+    if (cmd == "quit")
+      return "";
+    if (cmd == "camera")
+    {
+      std::string name;
+      s >> name;
+      auto cam = std::find_if(sc.cameras.begin(), sc.cameras.end(),
+                              [&](auto &c)
+                              { return c.first == name; });
+      if (cam == sc.cameras.end())
+      {
+        error = "no camera " + name;
+        break;
+      }
+      static_cast<view &>(sc) = cam->second;
+    }
+    else if (!parse_view(s, cmd, sc))
+    {
+      error = "unknown command " + cmd;
+      break;
+    }
+    if (s.fail())
+    {
+      error = "bad arguments to " + cmd;
+      break;
+    }
+  }
+
+  if (error.empty() && !window_valid(sc))
+    error = "empty crop window";
+
+  if (error.empty())
+  {
+    auto start = std::chrono::steady_clock::now();
+    if (render_file(sc, opts))
+    {
+      std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+      std::ostringstream reply;
+      reply << "ok " << sc.filename << ' ' << elapsed.count();
+      static_cast<view &>(sc) = saved;
+      return reply.str();
+    }
+    error = "cannot render " + sc.filename;
+  }
+
+  static_cast<view &>(sc) = saved;
+  return "error " + error;
+}
+
+void serve(scene &sc, const render_options &opts, std::istream &in, std::ostream &out)
+{
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    auto reply = handle(sc, opts, line);
+    if (reply.empty())
+      return;
+    out << reply << std::endl;
+  }
+}
+
+bool serve_socket(scene &sc, const render_options &opts, const std::string &path)
+{
+  // a client hanging up early must not take the server down
+  std::signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+  {
+    std::cerr << "socket path too long: " << path << std::endl;
+    return false;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  // a socket left behind by an earlier server is replaced; anything else at
+  // path is kept, and bind fails on it
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(fd, 4))
+  {
+    std::cerr << "cannot listen on " << path << ": " << strerror(errno) << std::endl;
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  bool running = true;
+  while (running)
+  {
+    int conn = accept(fd, nullptr, nullptr);
+    if (conn < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    std::string pending;
+    char buf[4096];
+    ssize_t n;
+    while (running && (n = read(conn, buf, sizeof(buf))) > 0)
+    {
+      pending.append(buf, n);
+      size_t eol;
+      while (running && (eol = pending.find('\n')) != std::string::npos)
+      {
+        auto line = pending.substr(0, eol);
+        pending.erase(0, eol + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+          continue;
+        auto reply = handle(sc, opts, line);
+        if (reply.empty())
+        {
+          running = false;
+          break;
+        }
+        reply += '\n';
+        if (!send_all(conn, reply.data(), reply.size()))
+          break;
+      }
+    }
+    close(conn);
+  }
+
+  close(fd);
+  unlink(path.c_str());
+  return true;
+}
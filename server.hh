@@ -0,0 +1,18 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include "render.hh"
+
+/**
+ * Keeps a parsed scene, its textures and BVH resident and renders one image
+ * per request. A request is a line of view commands (png, output, eye,
+ * forward, up, aa, crop, ...) applied on top of the scene file's own view, or
+ * of a named camera picked with "camera NAME", for that render only. Every
+ * request gets a one-line answer, "ok FILE SECONDS" or "error MESSAGE";
+ * "quit" stops the server.
+ */
+void serve(scene &sc, const render_options &opts, std::istream &in, std::ostream &out);
+
+// the same protocol on a Unix socket, one connection at a time
+bool serve_socket(scene &sc, const render_options &opts, const std::string &path);
@@ -1,3 +1,4 @@
+#include <cmath>
 #include "lodepng.hh"
 #include "texture.hh"
 
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <thread>
+#include "tiles.hh"
+
+bool parse_curve(const std::string &name, curve &c)
+{
+  if (name == "row")
+    c = curve::row;
+  else if (name == "morton")
+    c = curve::morton;
+  else if (name == "hilbert")
+    c = curve::hilbert;
+  else if (name == "spiral")
+    c = curve::spiral;
+  else
+    return false;
+  return true;
+}
+
+// interleaves the bits of x and y
+static uint64_t morton_index(uint32_t x, uint32_t y)
+{
+  uint64_t m = 0;
+  for (int b = 0; b < 32; ++b)
+  {
+    m |= uint64_t((x >> b) & 1) << (2 * b);
+    m |= uint64_t((y >> b) & 1) << (2 * b + 1);
+  }
+  return m;
+}
+
+// position of (x, y) along the Hilbert curve through an n x n grid, n a power of 2
+static uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y)
+{
+  uint64_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2)
+  {
+    uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+    d += uint64_t(s) * s * ((3 * rx) ^ ry);
+    // rotate the quadrant so the curve inside it starts where the last one ended
+    if (!ry)
+    {
+      if (rx)
+      {
+        x = s - 1 - (x & (s - 1));
+        y = s - 1 - (y & (s - 1));
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+std::vector<int> curve_order(int w, int h, curve c)
+{
+  if (w <= 0 || h <= 0)
+    return {};
+  std::vector<int> cells(w * h);
+  std::iota(cells.begin(), cells.end(), 0);
+  if (c == curve::row)
+    return cells;
+
+  uint32_t n = 1;
+  while (n < uint32_t(std::max(w, h)))
+    n *= 2;
+
+  std::vector<double> key(cells.size());
+  for (int y = 0; y < h; ++y)
+  {
+    for (int x = 0; x < w; ++x)
+    {
+      auto &k = key[y * w + x];
+      if (c == curve::morton)
+      {
+        k = morton_index(x, y);
+      }
+      else if (c == curve::hilbert)
+      {
+        k = hilbert_index(n, x, y);
+      }
+      else
+      {
+        // ring by ring outwards, each ring walked by angle
+        double dx = x + 0.5 - w / 2.0, dy = y + 0.5 - h / 2.0;
+        double ring = std::floor(std::max(std::abs(dx), std::abs(dy)));
+        k = ring * 8 + std::atan2(dy, dx) + M_PI;
+      }
+    }
+  }
+  std::stable_sort(cells.begin(), cells.end(), [&](int a, int b)
+                   { return key[a] < key[b]; });
+  return cells;
+}
+
+std::vector<tile> make_tiles(tile area, int size, curve c)
+{
+  int cols = (area.x1 - area.x0 + size - 1) / size;
+  int rows = (area.y1 - area.y0 + size - 1) / size;
+  std::vector<tile> tiles;
+  for (auto cell : curve_order(cols, rows, c))
+  {
+    int x = area.x0 + cell % cols * size, y = area.y0 + cell / cols * size;
+    tiles.push_back({x, y, std::min(x + size, area.x1), std::min(y + size, area.y1)});
+  }
+  return tiles;
+}
+
+pixel_order::pixel_order(int size, curve c) : size(size)
+{
+  if (c != curve::row)
+    positions = curve_order(size, size, c);
+}
+
+void tile_deque::push(tile *t)
+{
+  std::lock_guard<std::mutex> lock(m);
+  q.push_back(t);
+}
+
+bool tile_deque::pop(tile *&t)
+{
+  std::lock_guard<std::mutex> lock(m);
+  if (q.empty())
+    return false;
+  t = q.front();
+  q.pop_front();
+  return true;
+}
+
+bool tile_deque::steal(tile *&t)
+{
+  std::lock_guard<std::mutex> lock(m);
+  if (q.empty())
+    return false;
+  t = q.back();
+  q.pop_back();
+  return true;
+}
+
+int tile_owner(size_t i, size_t tiles, int threads)
+{
+  threads = std::max(1, std::min<int>(threads, tiles));
+  return i * threads / tiles;
+}
+
+void parallel_tiles(std::vector<tile> &tiles, int threads,
+                    const std::function<void(tile &, int)> &fn,
+                    const worker_placement *placement)
+{
+  threads = std::max(1, std::min<int>(threads, tiles.size()));
+
+  if (threads == 1 && !placement)
+  {
+    for (auto &t : tiles)
+      fn(t, 0);
+    return;
+  }
+
+  std::vector<tile_deque> deques(threads);
+  for (size_t i = 0; i < tiles.size(); ++i)
+  {
+    deques[tile_owner(i, tiles.size(), threads)].push(&tiles[i]);
+  }
+
+  // victims in the order each worker tries them: its own group first
+  std::vector<std::vector<int>> victims(threads);
+  for (int id = 0; id < threads; ++id)
+  {
+    for (int k = 1; k < threads; ++k)
+    {
+      victims[id].push_back((id + k) % threads);
+    }
+    if (placement)
+    {
+      auto &group = placement->group;
+      std::stable_partition(victims[id].begin(), victims[id].end(),
+                            [&](int v)
+                            { return group[v] == group[id]; });
+    }
+  }
+
+  auto work = [&](int id)
+  {
+    if (placement && placement->setup)
+      placement->setup(id);
+
+    tile *t;
+    for (;;)
+    {
+      if (deques[id].pop(t))
+      {
+        fn(*t, id);
+        continue;
+      }
+      // no new work is ever pushed, so one empty sweep means we're done
+      bool stolen = false;
+      for (auto v : victims[id])
+      {
+        if ((stolen = deques[v].steal(t)))
+          break;
+      }
+      if (!stolen)
+        return;
+      fn(*t, id);
+    }
+  };
+
+  // placed workers get threads of their own, so the caller's stays unpinned
+  std::vector<std::thread> pool;
+  for (int id = placement ? 0 : 1; id < threads; ++id)
+  {
+    pool.emplace_back(work, id);
+  }
+  if (!placement)
+    work(0);
+  for (auto &th : pool)
+  {
+    th.join();
+  }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct tile
+{
+  int x0, y0, x1, y1;
+};
+
+/**
+ * Orders for walking a grid: row-major, or a space-filling curve that keeps
+ * consecutive cells close together, so consecutive rays share more of their
+ * BVH path while it is still in cache. spiral starts at the center, which
+ * is usually where the interesting part of the image is.
+ */
+enum class curve
+{
+  row,
+  morton,
+  hilbert,
+  spiral
+};
+
+bool parse_curve(const std::string &name, curve &c);
+// the cells y * w + x of a w x h grid in the order c visits them
+std::vector<int> curve_order(int w, int h, curve c);
+
+// splits area into tiles of size x size pixels, listed in the order c
+std::vector<tile> make_tiles(tile area, int size, curve c = curve::row);
+
+/**
+ * The order the pixels of a tile are visited in, as positions in a full
+ * size x size tile; smaller tiles at the edges skip the positions they don't
+ * have. Row-major order needs no table.
+ */
+struct pixel_order
+{
+  int size = 0;
+  std::vector<int> positions;
+
+  pixel_order() = default;
+  pixel_order(int size, curve c);
+};
+
+template <typename F>
+void for_each_pixel(const tile &t, const pixel_order &order, F fn)
+{
+  if (order.positions.empty())
+  {
+    for (int i = t.y0; i < t.y1; ++i)
+    {
+      for (int j = t.x0; j < t.x1; ++j)
+        fn(i, j);
+    }
+    return;
+  }
+  for (auto p : order.positions)
+  {
+    int i = t.y0 + p / order.size, j = t.x0 + p % order.size;
+    if (i < t.y1 && j < t.x1)
+      fn(i, j);
+  }
+}
+
+/**
+ * A tile deque shared between its owner and thieves. The owner takes work from
+ * the front, so it walks its share of the image in order; thieves take from
+ * the back, which is the work farthest away from what the owner is touching.
+ */
+class tile_deque
+{
+  std::mutex m;
+  std::deque<tile *> q;
+
+public:
+  void push(tile *t);
+  bool pop(tile *&t);
+  bool steal(tile *&t);
+};
+
+/**
+ * Where parallel_tiles workers run: the group (NUMA node) of every worker, and
+ * setup, called on each worker's own thread before it takes any tiles. Workers
+ * steal within their group before they steal from other groups.
+ */
+struct worker_placement
+{
+  std::vector<int> group;
+  std::function<void(int)> setup;
+};
+
+/**
+ * Calls fn(tile, worker) for every tile on `threads` worker threads. Every
+ * worker starts with a contiguous run of tiles and steals from the others once
+ * its own deque runs dry, so expensive regions of the image don't leave the
+ * rest of the pool idle.
+ */
+void parallel_tiles(std::vector<tile> &tiles, int threads,
+                    const std::function<void(tile &, int)> &fn,
+                    const worker_placement *placement = nullptr);
+
+// the worker whose deque parallel_tiles seeds with tiles[i]
+int tile_owner(size_t i, size_t tiles, int threads);
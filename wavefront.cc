@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cstdint>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include "integrator.hh"
+#include "wavefront.hh"
+
+// what one tree of rays adds up to: a camera sample, or the light coming back
+// along an indirect ray
+struct wave_result
+{
+  object *obj_hit = nullptr;
+  vec p, intensity;
+};
+
+struct wave_ray
+{
+  vec o, dir, weight;
+  int d, bounces;
+  // the result it adds to, -1 for an indirect ray that has none yet; first
+  // rays tell their result what they hit
+  int result;
+  bool first;
+  // whether it, or a ray before it, went off in a random direction
+  bool scattered;
+  rng gen;
+};
+
+// a hit that takes diffuse light
+struct wave_hit
+{
+  object *obj;
+  vec p, n, lit, diffuse;
+  // its lights, in the wave's chosen
+  int first, count;
+};
+
+// an indirect ray, whose result lights the hit that sent it like a point
+// light once it has been traced
+struct wave_bounce
+{
+  int parent, child;
+  object *obj;
+  vec p, n, lit;
+};
+
+// origins are binned into a grid of 2^cell_bits cells a side over the BVH,
+// fine enough that Morton order keeps nearby origins together at any scale
+static const int cell_bits = 8;
+
+// spreads the low 10 bits of x out to every third bit
+static uint32_t spread3(uint32_t x)
+{
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+/**
+ * A key that brings rays likely to visit the same BVH nodes together: the
+ * octant of the direction, then the Morton index of the origin's grid cell.
+ */
+static uint64_t coherence_key(const aabb &box, const wave_ray &ray)
+{
+  auto cell = [](float v, float lo, float hi)
+  {
+    const int n = 1 << cell_bits;
+    return uint32_t(std::clamp(int((v - lo) / (hi - lo) * n), 0, n - 1));
+  };
+  uint64_t octant = (ray.dir.x < 0) | (ray.dir.y < 0) << 1 | (ray.dir.z < 0) << 2;
+  uint32_t x = cell(ray.o.x, box.x1, box.x2), y = cell(ray.o.y, box.y1, box.y2),
+           z = cell(ray.o.z, box.z1, box.z2);
+  return octant << (3 * cell_bits) | spread3(x) | spread3(y) << 1 | spread3(z) << 2;
+}
+
+size_t trace_wavefront(scene &sc, framebuffer &fb, tile &t, const pixel_order &order, int limit,
+                       const render_options &opts)
+{
+  std::vector<wave_result> results;
+  std::vector<std::pair<int, int>> pixels;
+  std::vector<wave_ray> rays;
+
+  // results[k] is the sample of pixels[k]
+  for_each_pixel(t, order, [&](int i, int j)
+                 {
+                   auto p = fb.index(i, j);
+                   if (!needs_sample(sc, limit, fb.samples[p], luminance(fb.sum[p]), fb.sum2[p]))
+                     return;
+                   rng gen(i * sc.width + j, fb.samples[p]);
+                   vec o, dir;
+                   if (camera_ray(sc, i, j, gen, o, dir))
+                     rays.push_back({o, dir, vec(1, 1, 1), sc.d, sc.bounces, int(results.size()), true, false, gen.split(0)});
+                   pixels.push_back({i, j});
+                   results.emplace_back();
+                 });
+  size_t taken = pixels.size();
+
+  std::vector<std::pair<object *, float>> found;
+  std::vector<int> tracing;
+  // keys in the high half, ray indices in the low
+  std::vector<uint64_t> scattered;
+  std::vector<int> shading;
+  std::vector<int> hit_of;
+  std::vector<wave_hit> hits;
+  std::vector<light_choice> chosen;
+  std::vector<std::pair<int, wave_ray>> spawned;
+  std::vector<wave_ray> next;
+  std::vector<wave_bounce> bounces;
+
+  for (bool primary = true; !rays.empty(); primary = false)
+  {
+    // rays that only ever met smooth surfaces are still about as coherent as
+    // the camera rays were, in pixel order, so they go first as they are;
+    // scattered rays follow in coherence_key order
+    tracing.clear();
+    scattered.clear();
+    for (size_t r = 0; r < rays.size(); ++r)
+    {
+      if (opts.reorder_rays && rays[r].scattered)
+        scattered.push_back(coherence_key(sc.objects.bounds(), rays[r]) << 32 | r);
+      else
+        tracing.push_back(r);
+    }
+    std::sort(scattered.begin(), scattered.end());
+    for (auto key : scattered)
+      tracing.push_back(uint32_t(key));
+
+    found.resize(rays.size());
+    if (primary && opts.packets)
+    {
+      // camera rays in pixel order, so each packet is a run of neighbours
+      for (size_t k = 0; k < tracing.size(); k += ray_packet::size)
+      {
+        ray_packet packet;
+        for (size_t m = k; m < std::min(tracing.size(), k + ray_packet::size); ++m)
+          packet.add(rays[tracing[m]].o, rays[tracing[m]].dir);
+        object *obj_hit[ray_packet::size];
+        float t_hit[ray_packet::size];
+        sc.objects.intersect(packet, obj_hit, t_hit);
+        for (int m = 0; m < packet.count; ++m)
+          found[tracing[k + m]] = {obj_hit[m], t_hit[m]};
+      }
+    }
+    else
+    {
+      for (auto r : tracing)
+        found[r] = sc.objects.intersect(rays[r].o, rays[r].dir);
+    }
+    rays_traced += rays.size();
+
+    shading.clear();
+    for (auto r : tracing)
+    {
+      if (found[r].first)
+        shading.push_back(r);
+    }
+
+    // shading one object after another keeps its code and data hot; nothing
+    // below depends on this order, so it needn't be stable across runs
+    std::sort(shading.begin(), shading.end(), [&](int a, int b)
+              {
+                auto *x = found[a].first, *y = found[b].first;
+                std::type_index tx(typeid(*x)), ty(typeid(*y));
+                if (tx != ty)
+                  return tx < ty;
+                if (x != y)
+                  return std::less<object *>()(x, y);
+                return a < b;
+              });
+
+    hit_of.assign(rays.size(), -1);
+    hits.clear();
+    chosen.clear();
+    spawned.clear();
+    for (auto r : shading)
+    {
+      auto &ray = rays[r];
+      auto [obj_hit, t_hit] = found[r];
+      auto p = ray.o + t_hit * ray.dir;
+      if (ray.first)
+      {
+        results[ray.result].obj_hit = obj_hit;
+        results[ray.result].p = p;
+      }
+
+      hit_shading hit;
+      int first = chosen.size();
+      shade_hit(sc, obj_hit, p, ray.dir, ray.weight, ray.d, ray.bounces, ray.gen, chosen, hit);
+      if (hit.diffuse)
+      {
+        hit_of[r] = hits.size();
+        hits.push_back({obj_hit, p, hit.n, hit.lit, vec(), first, int(chosen.size()) - first});
+        if (hit.indirect)
+          spawned.push_back({r, {p, hit.indirect_dir, vec(1, 1, 1), ray.d - 1, ray.bounces, -1, true, true, ray.gen.split(0)}});
+      }
+
+      bool scattered = ray.scattered || obj_hit->roughness;
+      for (int k = 0; k < hit.count; ++k)
+      {
+        auto &s = hit.rays[k];
+        spawned.push_back({r, {s.o, s.dir, s.weight, ray.d, ray.bounces - 1, ray.result, false, scattered, ray.gen.split(s.branch)}});
+      }
+    }
+
+    // shadow rays, the k-th light of every hit at a time, which is the same
+    // light but for those sampled from the light tree
+    for (int k = 0, more = 1; more; ++k)
+    {
+      more = 0;
+      for (auto &h : hits)
+      {
+        if (k >= h.count)
+          continue;
+        auto [l, weight] = chosen[h.first + k];
+        h.diffuse += weight * illuminate(sc, *sc.lights[l], h.obj, h.p, h.n, l);
+        more = 1;
+      }
+    }
+
+    // light is summed, and new results made, in ray order, so the image
+    // doesn't depend on the shading order
+    for (size_t r = 0; r < rays.size(); ++r)
+    {
+      if (hit_of[r] >= 0)
+        results[rays[r].result].intensity += hits[hit_of[r]].lit * hits[hit_of[r]].diffuse;
+    }
+    std::stable_sort(spawned.begin(), spawned.end(), [](const auto &a, const auto &b)
+                     { return a.first < b.first; });
+    next.clear();
+    for (auto &[r, ray] : spawned)
+    {
+      if (ray.result < 0)
+      {
+        auto &h = hits[hit_of[r]];
+        ray.result = results.size();
+        bounces.push_back({rays[r].result, ray.result, h.obj, h.p, h.n, h.lit});
+        results.emplace_back();
+      }
+      next.push_back(ray);
+    }
+    std::swap(rays, next);
+  }
+
+  // deeper bounces were made later, so this lights every result before it
+  // becomes a light itself
+  for (auto b = bounces.rbegin(); b != bounces.rend(); ++b)
+  {
+    auto &res = results[b->child];
+    if (res.obj_hit)
+    {
+      point_light l(res.p, res.intensity);
+      results[b->parent].intensity += b->lit * illuminate(sc, l, b->obj, b->p, b->n);
+    }
+  }
+
+  for (size_t k = 0; k < taken; ++k)
+  {
+    auto [i, j] = pixels[k];
+    fb.add(i, j, results[k].intensity, results[k].obj_hit != nullptr);
+  }
+  return taken;
+}
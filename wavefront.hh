@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include "framebuffer.hh"
+#include "render.hh"
+#include "scene.hh"
+#include "tiles.hh"
+
+/**
+ * Takes the next sample, below limit, of every pixel of t that needs one, all
+ * at once: the rays of each bounce are intersected as one wave, the hits
+ * sorted by object, so by kind of object and material, and shaded in that
+ * order, their shadow rays traced as a batch, and the reflection, refraction
+ * and indirect rays they spawn make up the next wave. Every ray draws the
+ * same random numbers as in ray_trace, so the image is the same up to the
+ * order light is summed in. With opts.packets, camera rays go through the
+ * BVH in packets of neighbours. With opts.reorder_rays, the rays of a wave
+ * that have scattered, off a rough surface or as indirect light, are
+ * intersected grouped by direction octant and origin, see coherence_key,
+ * which changes what is in cache but not the image. Returns how many samples
+ * it took.
+ */
+size_t trace_wavefront(scene &sc, framebuffer &fb, tile &t, const pixel_order &order, int limit,
+                       const render_options &opts);